@@ -2,7 +2,13 @@
 // ==============
 //
 // With GCC:
-//   gcc -std=c++11 -O3 kitchenconv.cpp -lstdc++ -o kitchenconv
+//   gcc -std=c++11 -O3 -pthread kitchenconv.cpp -lstdc++ -o kitchenconv
+//
+// Integer-only build, for devices without an FPU:
+//   gcc -std=c++11 -O3 -pthread -DKITCHENCONV_FIXED_POINT kitchenconv.cpp -lstdc++ -o kitchenconv-fixed
+//
+// With gzip support in batch mode (needs zlib):
+//   gcc -std=c++11 -O3 -pthread -DKITCHENCONV_WITH_ZLIB kitchenconv.cpp -lstdc++ -lz -o kitchenconv
 //
 
 #include <iostream>
@@ -12,6 +18,78 @@
 #include <vector>
 #include <algorithm>
 #include <map>
+#include <array>
+#include <cstdint>
+#include <iomanip>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <fstream>
+#include <memory>
+#include <thread>
+#include <system_error>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifdef KITCHENCONV_WITH_ZLIB
+#include <zlib.h>
+#include <stdexcept>
+#endif
+
+// Static tracepoints (USDT) for bpftrace or systemtap, for example:
+//   bpftrace -e 'usdt:./kitchenconv:kitchenconv:unit_resolved { printf("%s %d\n", str(arg0), arg1); }'
+// Each probe compiles to a single nop unless a tracer is attached. They are
+// only available when <sys/sdt.h> is installed (systemtap-sdt-dev), and can be
+// disabled with -DKITCHENCONV_NO_USDT.
+#if defined(__has_include) && !defined(KITCHENCONV_NO_USDT)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define KITCHENCONV_USDT
+#endif
+#endif
+
+#ifdef KITCHENCONV_USDT
+#define KC_PROBE1(name, a1)         DTRACE_PROBE1(kitchenconv, name, a1)
+#define KC_PROBE2(name, a1, a2)     DTRACE_PROBE2(kitchenconv, name, a1, a2)
+#define KC_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(kitchenconv, name, a1, a2, a3)
+#else
+#define KC_PROBE1(name, a1)
+#define KC_PROBE2(name, a1, a2)
+#define KC_PROBE3(name, a1, a2, a3)
+#endif
+
+// Number representation
+// =====================
+//
+// By default quantities and conversion factors are doubles. Building with
+// -DKITCHENCONV_FIXED_POINT selects an integer-only profile for devices
+// without an FPU: quantities are stored in millionths, unit factors in
+// billionths of SI units (kg, L) and densities in millionths of kg/L. The
+// table factors below are converted at compile time, and parsing,
+// conversion and formatting then use only integer arithmetic.
+#ifdef KITCHENCONV_FIXED_POINT
+typedef std::int64_t number;
+const number number_one  = 1000000;
+const number factor_one  = 1000000000;
+const number density_one = 1000000;
+#define KC_FACTOR(x)  number((x)*1e9 + 0.5)
+#define KC_DENSITY(x) number((x)*1e6 + 0.5)
+#define KC_AMOUNT(x)  number((x)*1e6 + 0.5)
+#else
+typedef double number;
+#define KC_FACTOR(x)  (x)
+#define KC_DENSITY(x) (x)
+#define KC_AMOUNT(x)  number(x)
+#endif
 
 enum class unit_type {
     none,
@@ -31,9 +109,9 @@ std::string unit_type_name(unit_type t) {
 
 struct unit {
     unit() = default;
-    unit(double c, unit_type t) : to_si(c), type(t) {}
+    unit(number c, unit_type t) : to_si(c), type(t) {}
 
-    double to_si = 1;
+    number to_si = 1;
     unit_type type = unit_type::none;
 };
 
@@ -60,64 +138,119 @@ inline std::size_t string_distance(const std::string& t, const std::string& u) {
     return d + best_d;
 }
 
-std::map<std::string, double> density_table = {
-    {"flour",         0.5283},
-    {"butter",        0.9586},
-    {"sugar",         0.8453},
-    {"salt",          1.1548},
-    {"baking-powder", 1.1548},
-    {"baking-soda",   0.9337},
-    {"baking-powder", 0.7208},
-    {"almond-flour",  0.5679},
-    {"tomato-paste",  1.1075},
-    {"tomato-puree",  1.1075},
-    {"rice",          0.8453},
-    {"tofu",          1.0480},
-    {"parmesan",      0.4227},
-    {"oil",           0.9215},
-    {"water",         1.0000},
-    {"parsley",       0.10566},
-    {"basil",         0.10566},
-    {"cilantro",      0.10566},
-    {"dill",          0.10566},
-    {"herbs",         0.10566}
+std::map<std::string, number> density_table = {
+    {"flour",         KC_DENSITY(0.5283)},
+    {"butter",        KC_DENSITY(0.9586)},
+    {"sugar",         KC_DENSITY(0.8453)},
+    {"salt",          KC_DENSITY(1.1548)},
+    {"baking-powder", KC_DENSITY(1.1548)},
+    {"baking-soda",   KC_DENSITY(0.9337)},
+    {"baking-powder", KC_DENSITY(0.7208)},
+    {"almond-flour",  KC_DENSITY(0.5679)},
+    {"tomato-paste",  KC_DENSITY(1.1075)},
+    {"tomato-puree",  KC_DENSITY(1.1075)},
+    {"rice",          KC_DENSITY(0.8453)},
+    {"tofu",          KC_DENSITY(1.0480)},
+    {"parmesan",      KC_DENSITY(0.4227)},
+    {"oil",           KC_DENSITY(0.9215)},
+    {"water",         KC_DENSITY(1.0000)},
+    {"parsley",       KC_DENSITY(0.10566)},
+    {"basil",         KC_DENSITY(0.10566)},
+    {"cilantro",      KC_DENSITY(0.10566)},
+    {"dill",          KC_DENSITY(0.10566)},
+    {"herbs",         KC_DENSITY(0.10566)}
 };
 
 std::map<std::string, unit> unit_table = {
-    {"kg",         unit{1.0,      unit_type::weight}},
-    {"g",          unit{1e-3,     unit_type::weight}},
-    {"gram",       unit{1e-3,     unit_type::weight}},
-    {"grams",      unit{1e-3,     unit_type::weight}},
-    {"mg",         unit{1e-6,     unit_type::weight}},
-    {"lb",         unit{4.536e-1, unit_type::weight}},
-    {"pound",      unit{4.536e-1, unit_type::weight}},
-    {"pounds",     unit{4.536e-1, unit_type::weight}},
-    {"oz",         unit{2.835e-2, unit_type::weight}},
-    {"ounce",      unit{2.835e-2, unit_type::weight}},
-    {"ounces",     unit{2.835e-2, unit_type::weight}},
-
-    {"l",          unit{1.0,      unit_type::volume}},
-    {"liter",      unit{1.0,      unit_type::volume}},
-    {"liters",     unit{1.0,      unit_type::volume}},
-    {"dl",         unit{1e-1,     unit_type::volume}},
-    {"cl",         unit{1e-2,     unit_type::volume}},
-    {"ml",         unit{1e-3,     unit_type::volume}},
-    {"gal",        unit{3.785,    unit_type::volume}},
-    {"galon",      unit{3.785,    unit_type::volume}},
-    {"galons",     unit{3.785,    unit_type::volume}},
-    {"cup",        unit{2.366e-1, unit_type::volume}},
-    {"cups",       unit{2.366e-1, unit_type::volume}},
-    {"floz",       unit{2.957e-2, unit_type::volume}},
-    {"tbs",        unit{1.479e-2, unit_type::volume}},
-    {"ts",         unit{4.93e-3,  unit_type::volume}},
-
-    {"c",          unit{1.0,      unit_type::temperature}}, // 1: celcius
-    {"celcius",    unit{1.0,      unit_type::temperature}}, // 1: celcius
-    {"f",          unit{0.0,      unit_type::temperature}}, // 0: fahrenheit
-    {"fahrenheit", unit{0.0,      unit_type::temperature}}  // 0: fahrenheit
+    {"kg",         unit{KC_FACTOR(1.0),      unit_type::weight}},
+    {"g",          unit{KC_FACTOR(1e-3),     unit_type::weight}},
+    {"gram",       unit{KC_FACTOR(1e-3),     unit_type::weight}},
+    {"grams",      unit{KC_FACTOR(1e-3),     unit_type::weight}},
+    {"mg",         unit{KC_FACTOR(1e-6),     unit_type::weight}},
+    {"lb",         unit{KC_FACTOR(4.536e-1), unit_type::weight}},
+    {"pound",      unit{KC_FACTOR(4.536e-1), unit_type::weight}},
+    {"pounds",     unit{KC_FACTOR(4.536e-1), unit_type::weight}},
+    {"lbs",        unit{KC_FACTOR(4.536e-1), unit_type::weight}},
+    {"oz",         unit{KC_FACTOR(2.835e-2), unit_type::weight}},
+    {"ounce",      unit{KC_FACTOR(2.835e-2), unit_type::weight}},
+    {"ounces",     unit{KC_FACTOR(2.835e-2), unit_type::weight}},
+
+    {"l",          unit{KC_FACTOR(1.0),      unit_type::volume}},
+    {"liter",      unit{KC_FACTOR(1.0),      unit_type::volume}},
+    {"liters",     unit{KC_FACTOR(1.0),      unit_type::volume}},
+    {"dl",         unit{KC_FACTOR(1e-1),     unit_type::volume}},
+    {"cl",         unit{KC_FACTOR(1e-2),     unit_type::volume}},
+    {"ml",         unit{KC_FACTOR(1e-3),     unit_type::volume}},
+    {"milliliter", unit{KC_FACTOR(1e-3),     unit_type::volume}},
+    {"milliliters", unit{KC_FACTOR(1e-3),     unit_type::volume}},
+    {"gal",        unit{KC_FACTOR(3.785),    unit_type::volume}},
+    {"galon",      unit{KC_FACTOR(3.785),    unit_type::volume}},
+    {"galons",     unit{KC_FACTOR(3.785),    unit_type::volume}},
+    {"cup",        unit{KC_FACTOR(2.366e-1), unit_type::volume}},
+    {"cups",       unit{KC_FACTOR(2.366e-1), unit_type::volume}},
+    {"floz",       unit{KC_FACTOR(2.957e-2), unit_type::volume}},
+    {"tbs",        unit{KC_FACTOR(1.479e-2), unit_type::volume}},
+    {"tbsp",       unit{KC_FACTOR(1.479e-2), unit_type::volume}},
+    {"tablespoon", unit{KC_FACTOR(1.479e-2), unit_type::volume}},
+    {"tablespoons", unit{KC_FACTOR(1.479e-2), unit_type::volume}},
+    {"ts",         unit{KC_FACTOR(4.93e-3),  unit_type::volume}},
+    {"tsp",        unit{KC_FACTOR(4.93e-3),  unit_type::volume}},
+    {"teaspoon",   unit{KC_FACTOR(4.93e-3),  unit_type::volume}},
+    {"teaspoons",  unit{KC_FACTOR(4.93e-3),  unit_type::volume}},
+
+    {"c",          unit{KC_FACTOR(1.0),      unit_type::temperature}}, // 1: celcius
+    {"celcius",    unit{KC_FACTOR(1.0),      unit_type::temperature}}, // 1: celcius
+    {"f",          unit{KC_FACTOR(0.0),      unit_type::temperature}}, // 0: fahrenheit
+    {"fahrenheit", unit{KC_FACTOR(0.0),      unit_type::temperature}}  // 0: fahrenheit
+};
+
+// Nutrients per 100 g, for the substances of density_table. Approximate
+// values from the USDA food composition tables (SR Legacy).
+const std::size_t nutrient_count = 5;
+const char* nutrient_names[nutrient_count] = {
+    "kcal", "protein_g", "fat_g", "carbs_g", "sodium_mg"
 };
 
-void sort_and_cerr(std::vector<std::string> values, std::string attempt) {
+typedef std::array<number, nutrient_count> nutrients;
+
+std::map<std::string, nutrients> nutrient_table = {
+    //                       kcal                 protein              fat                  carbs                sodium
+    {"flour",         {{KC_AMOUNT(364), KC_AMOUNT(10.3),  KC_AMOUNT(0.98),  KC_AMOUNT(76.3),  KC_AMOUNT(2)}}},
+    {"butter",        {{KC_AMOUNT(717), KC_AMOUNT(0.85),  KC_AMOUNT(81.1),  KC_AMOUNT(0.06),  KC_AMOUNT(643)}}},
+    {"sugar",         {{KC_AMOUNT(387), KC_AMOUNT(0),     KC_AMOUNT(0),     KC_AMOUNT(100),   KC_AMOUNT(1)}}},
+    {"salt",          {{KC_AMOUNT(0),   KC_AMOUNT(0),     KC_AMOUNT(0),     KC_AMOUNT(0),     KC_AMOUNT(38758)}}},
+    {"baking-powder", {{KC_AMOUNT(53),  KC_AMOUNT(0),     KC_AMOUNT(0),     KC_AMOUNT(27.7),  KC_AMOUNT(10600)}}},
+    {"baking-soda",   {{KC_AMOUNT(0),   KC_AMOUNT(0),     KC_AMOUNT(0),     KC_AMOUNT(0),     KC_AMOUNT(27360)}}},
+    {"almond-flour",  {{KC_AMOUNT(579), KC_AMOUNT(21.2),  KC_AMOUNT(49.9),  KC_AMOUNT(21.6),  KC_AMOUNT(1)}}},
+    {"tomato-paste",  {{KC_AMOUNT(82),  KC_AMOUNT(4.32),  KC_AMOUNT(0.47),  KC_AMOUNT(18.9),  KC_AMOUNT(59)}}},
+    {"tomato-puree",  {{KC_AMOUNT(38),  KC_AMOUNT(1.65),  KC_AMOUNT(0.21),  KC_AMOUNT(8.98),  KC_AMOUNT(28)}}},
+    {"rice",          {{KC_AMOUNT(365), KC_AMOUNT(7.13),  KC_AMOUNT(0.66),  KC_AMOUNT(80.0),  KC_AMOUNT(5)}}},
+    {"tofu",          {{KC_AMOUNT(76),  KC_AMOUNT(8.08),  KC_AMOUNT(4.78),  KC_AMOUNT(1.87),  KC_AMOUNT(7)}}},
+    {"parmesan",      {{KC_AMOUNT(420), KC_AMOUNT(28.4),  KC_AMOUNT(27.8),  KC_AMOUNT(13.9),  KC_AMOUNT(1804)}}},
+    {"oil",           {{KC_AMOUNT(884), KC_AMOUNT(0),     KC_AMOUNT(100),   KC_AMOUNT(0),     KC_AMOUNT(0)}}},
+    {"water",         {{KC_AMOUNT(0),   KC_AMOUNT(0),     KC_AMOUNT(0),     KC_AMOUNT(0),     KC_AMOUNT(4)}}},
+    {"parsley",       {{KC_AMOUNT(36),  KC_AMOUNT(2.97),  KC_AMOUNT(0.79),  KC_AMOUNT(6.33),  KC_AMOUNT(56)}}},
+    {"basil",         {{KC_AMOUNT(23),  KC_AMOUNT(3.15),  KC_AMOUNT(0.64),  KC_AMOUNT(2.65),  KC_AMOUNT(4)}}},
+    {"cilantro",      {{KC_AMOUNT(23),  KC_AMOUNT(2.13),  KC_AMOUNT(0.52),  KC_AMOUNT(3.67),  KC_AMOUNT(46)}}},
+    {"dill",          {{KC_AMOUNT(43),  KC_AMOUNT(3.46),  KC_AMOUNT(1.12),  KC_AMOUNT(7.02),  KC_AMOUNT(61)}}},
+    {"herbs",         {{KC_AMOUNT(31),  KC_AMOUNT(2.93),  KC_AMOUNT(0.77),  KC_AMOUNT(4.92),  KC_AMOUNT(42)}}}  // average of the above
+};
+
+// nutrient_table is kept in sync with density_table by hand: a substance
+// without nutrients would silently drop out of the recipe totals.
+bool check_nutrient_table() {
+    bool ok = true;
+    for (auto& d : density_table) {
+        if (!nutrient_table.count(d.first)) {
+            std::cerr << "internal error: no nutrients for '" << d.first << "'" << std::endl;
+            ok = false;
+        }
+    }
+
+    return ok;
+}
+
+void sort_and_print(std::ostream& o, std::vector<std::string> values, std::string attempt) {
     std::sort(values.begin(), values.end(),
         [&](const std::string& s1, const std::string& s2) {
             return string_distance(attempt, s1) < string_distance(attempt, s2);
@@ -126,25 +259,30 @@ void sort_and_cerr(std::vector<std::string> values, std::string attempt) {
 
     bool first = true;
     for (auto& v : values) {
-        if (!first) std::cerr << ", ";
-        std::cerr << v;
+        if (!first) o << ", ";
+        o << v;
         first = false;
     }
-    std::cerr << std::endl;
+    o << std::endl;
 }
 
-bool make_unit(unit& u, const std::string& name) {
+bool make_unit(unit& u, const std::string& name, std::ostream& err, bool notes) {
     auto iter = unit_table.find(name);
+    KC_PROBE2(unit_resolved, name.c_str(), int(iter != unit_table.end()));
     if (iter == unit_table.end()) {
-        std::cerr << "error: unknown unit '" << name << "'" << std::endl;
-        std::cerr << "note: known units: ";
-        std::vector<std::string> units;
-        units.reserve(unit_table.size());
-        for (auto& v : unit_table) {
-            units.push_back(v.first);
+        KC_PROBE1(error_raised, "unknown_unit");
+        err << "error: unknown unit '" << name << "'" << std::endl;
+        if (notes) {
+            err << "note: known units: ";
+            std::vector<std::string> units;
+            units.reserve(unit_table.size());
+            for (auto& v : unit_table) {
+                units.push_back(v.first);
+            }
+
+            sort_and_print(err, std::move(units), name);
         }
 
-        sort_and_cerr(std::move(units), name);
         return false;
     }
 
@@ -167,141 +305,2567 @@ bool from_string(const std::string& s, T& v) {
     return !ss.fail() && ss.eof();
 }
 
-int main(int argc, char* argv[]) {
-    if (argc < 5) {
-        std::cout << "usage examples:" << std::endl;
-        std::cout << "  kitchenconv 10 kg to lb" << std::endl;
-        std::cout << "  kitchenconv 400 F in C" << std::endl;
-        std::cout << "  kitchenconv 1 tbs butter to g" << std::endl;
-        std::cout << "  kitchenconv 3 ts of sugar to g" << std::endl;
-        std::cout << "  kitchenconv 3/4 cup to ml" << std::endl;
-        return 1;
+// Returns the substances of density_table whose name contains 'text' (with
+// spaces read as dashes, as in requests), best matches first: the whole name,
+// then names starting with the text, then names with a word starting with it.
+// A linear scan is enough for a table of this size.
+std::vector<std::string> search_ingredients(std::string text) {
+    text = tolower(text);
+    std::replace(text.begin(), text.end(), ' ', '-');
+
+    if (text.empty()) return {};
+
+    std::vector<std::pair<std::size_t, std::string>> found;
+    for (auto& d : density_table) {
+        std::size_t pos = d.first.find(text);
+        if (pos == std::string::npos) continue;
+
+        std::size_t rank = 3;
+        if (d.first == text) {
+            rank = 0;
+        } else if (pos == 0) {
+            rank = 1;
+        } else if (d.first.find("-" + text) != std::string::npos) {
+            rank = 2;
+        }
+
+        found.emplace_back(rank, d.first);
+    }
+
+    std::sort(found.begin(), found.end(),
+        [](const std::pair<std::size_t, std::string>& f1, const std::pair<std::size_t, std::string>& f2) {
+            if (f1.first != f2.first) return f1.first < f2.first;
+            if (f1.second.size() != f2.second.size()) return f1.second.size() < f2.second.size();
+            return f1.second < f2.second;
+        }
+    );
+
+    std::vector<std::string> names;
+    names.reserve(found.size());
+    for (auto& f : found) {
+        names.push_back(f.second);
+    }
+
+    return names;
+}
+
+#ifdef KITCHENCONV_FIXED_POINT
+// Computes a*b/c rounded to the nearest integer, with a 128-bit intermediate
+// product built from 32-bit limbs so that no wider type is needed.
+bool muldiv(std::int64_t a, std::int64_t b, std::int64_t c, std::int64_t& r) {
+    if (c == 0) return false;
+
+    bool negative = ((a < 0) != (b < 0)) != (c < 0);
+    std::uint64_t ua = a < 0 ? -std::uint64_t(a) : a;
+    std::uint64_t ub = b < 0 ? -std::uint64_t(b) : b;
+    std::uint64_t uc = c < 0 ? -std::uint64_t(c) : c;
+
+    std::uint64_t al = ua & 0xffffffff, ah = ua >> 32;
+    std::uint64_t bl = ub & 0xffffffff, bh = ub >> 32;
+    std::uint64_t ll = al*bl, lh = al*bh, hl = ah*bl, hh = ah*bh;
+    std::uint64_t mid = (ll >> 32) + (lh & 0xffffffff) + (hl & 0xffffffff);
+    std::uint64_t lo = (ll & 0xffffffff) | (mid << 32);
+    std::uint64_t hi = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+
+    std::uint64_t q = 0, rem = 0;
+    for (int i = 127; i >= 0; --i) {
+        rem = (rem << 1) | ((i >= 64 ? hi >> (i - 64) : lo >> i) & 1);
+        if (rem >= uc) {
+            rem -= uc;
+            if (i >= 63) return false;
+            q |= std::uint64_t(1) << i;
+        }
+    }
+
+    if (rem >= uc - rem) ++q;
+    if (q > std::uint64_t(INT64_MAX)) return false;
+
+    r = negative ? -std::int64_t(q) : std::int64_t(q);
+    return true;
+}
+
+// Parses the same decimal and scientific notations as from_string<double>.
+bool parse_fixed(const std::string& s, std::int64_t& v) {
+    const std::int64_t max_mantissa = 100000000000000000;
+
+    std::size_t i = 0;
+    bool negative = false;
+    if (i < s.size() && (s[i] == '+' || s[i] == '-')) {
+        negative = s[i] == '-';
+        ++i;
+    }
+
+    std::int64_t mantissa = 0;
+    int exponent = 0;
+    bool digits = false;
+    for (; i < s.size() && std::isdigit(s[i]); ++i) {
+        digits = true;
+        if (mantissa < max_mantissa) {
+            mantissa = 10*mantissa + (s[i] - '0');
+        } else {
+            ++exponent;
+        }
+    }
+
+    if (i < s.size() && s[i] == '.') {
+        for (++i; i < s.size() && std::isdigit(s[i]); ++i) {
+            digits = true;
+            if (mantissa < max_mantissa) {
+                mantissa = 10*mantissa + (s[i] - '0');
+                --exponent;
+            }
+        }
+    }
+
+    if (!digits) return false;
+
+    if (i < s.size() && (s[i] == 'e' || s[i] == 'E')) {
+        ++i;
+        bool exp_negative = false;
+        if (i < s.size() && (s[i] == '+' || s[i] == '-')) {
+            exp_negative = s[i] == '-';
+            ++i;
+        }
+
+        if (i == s.size()) return false;
+
+        int e = 0;
+        for (; i < s.size() && std::isdigit(s[i]); ++i) {
+            if (e < 1000) e = 10*e + (s[i] - '0');
+        }
+
+        exponent += exp_negative ? -e : e;
+    }
+
+    if (i != s.size()) return false;
+
+    // Scale to millionths
+    exponent += 6;
+    for (; exponent > 0; --exponent) {
+        if (mantissa > INT64_MAX/10) return false;
+        mantissa *= 10;
+    }
+
+    if (exponent < 0) {
+        if (exponent < -18) {
+            mantissa = 0;
+        } else {
+            std::int64_t p = 1;
+            for (; exponent < 0; ++exponent) p *= 10;
+            mantissa = (mantissa + p/2)/p;
+        }
+    }
+
+    v = negative ? -mantissa : mantissa;
+    return true;
+}
+#endif
+
+bool parse_quantity(const std::string& s, number& v) {
+    auto slash_pos = s.find_first_of("/");
+    if (slash_pos != s.npos) {
+        std::string frac_up = s.substr(0, slash_pos);
+        std::string frac_low = s.substr(slash_pos+1);
+
+        std::size_t up = 0, low = 0;
+        if (!from_string(frac_up, up) || !from_string(frac_low, low)) {
+            return false;
+        }
+
+#ifdef KITCHENCONV_FIXED_POINT
+        if (up > std::size_t(INT64_MAX) || low > std::size_t(INT64_MAX)) return false;
+        return muldiv(up, number_one, low, v);
+#else
+        v = double(up)/double(low);
+        return true;
+#endif
+    }
+
+#ifdef KITCHENCONV_FIXED_POINT
+    return parse_fixed(s, v);
+#else
+    return from_string(s, v);
+#endif
+}
+
+number apply_density(number to_si, number density) {
+#ifdef KITCHENCONV_FIXED_POINT
+    return (to_si*density + density_one/2)/density_one;
+#else
+    return to_si*density;
+#endif
+}
+
+// Adds the nutrients of 'grams' of a substance to 'totals'. Returns false,
+// leaving 'totals' unchanged, if they do not fit in a number (fixed-point only).
+bool add_nutrients(nutrients& totals, const nutrients& per_100g, number grams) {
+#ifdef KITCHENCONV_FIXED_POINT
+    nutrients sum;
+    for (std::size_t i = 0; i < nutrient_count; ++i) {
+        number amount = 0;
+        if (!muldiv(grams, per_100g[i], 100*number_one, amount)) return false;
+        if (amount > 0 ? totals[i] > INT64_MAX - amount : totals[i] < INT64_MIN - amount) return false;
+        sum[i] = totals[i] + amount;
+    }
+
+    totals = sum;
+#else
+    for (std::size_t i = 0; i < nutrient_count; ++i) {
+        totals[i] += grams*per_100g[i]/100.0;
+    }
+#endif
+
+    return true;
+}
+
+// Returns false if the result does not fit in a number (fixed-point only).
+bool convert(number quantity, const unit& uf, const unit& ut, number& result) {
+#ifdef KITCHENCONV_FIXED_POINT
+    if (uf.type == unit_type::temperature) {
+        if (uf.to_si == ut.to_si) {
+            result = quantity;
+            return true;
+        } else if (uf.to_si) {
+            // Celcius to Fahrenheit
+            if (!muldiv(quantity, 9, 5, result)) return false;
+            if (result > INT64_MAX - 32*number_one) return false;
+            result += 32*number_one;
+            return true;
+        } else {
+            // Fahrenheit to Celcius
+            if (quantity < INT64_MIN + 32*number_one) return false;
+            return muldiv(quantity - 32*number_one, 5, 9, result);
+        }
+    } else {
+        return muldiv(quantity, uf.to_si, ut.to_si, result);
+    }
+#else
+    if (uf.type == unit_type::temperature) {
+        if (uf.to_si == ut.to_si) {
+            result = quantity;
+        } else if (uf.to_si) {
+            // Celcius to Fahrenheit
+            result = (9.0/5.0)*quantity + 32.0;
+        } else {
+            // Fahrenheit to Celcius
+            result = (5.0/9.0)*(quantity - 32.0);
+        }
+    } else {
+        result = quantity*uf.to_si/ut.to_si;
+    }
+
+    return true;
+#endif
+}
+
+std::string format_number(number v) {
+#ifdef KITCHENCONV_FIXED_POINT
+    // Round to 6 significant digits like std::ostream does for doubles, but
+    // never switch to scientific notation.
+    bool negative = v < 0;
+    std::uint64_t u = negative ? -std::uint64_t(v) : v;
+
+    std::uint64_t p = 1;
+    for (std::uint64_t t = u; t >= 1000000; t /= 10) p *= 10;
+    u = (u/p + (u%p >= p - u%p))*p;
+
+    std::string digits = std::to_string(u);
+    if (digits.size() < 7) digits.insert(0, 7 - digits.size(), '0');
+
+    std::string integer = digits.substr(0, digits.size() - 6);
+    std::string decimals = digits.substr(digits.size() - 6);
+    decimals.erase(decimals.find_last_not_of('0') + 1);
+
+    return (negative && u != 0 ? "-" : "") + integer +
+        (decimals.empty() ? "" : "." + decimals);
+#else
+    std::ostringstream ss;
+    ss << v;
+    return ss.str();
+#endif
+}
+
+#if defined(KITCHENCONV_FIXED_POINT) && !defined(KITCHENCONV_NO_ACCURACY_REPORT)
+// Compares the fixed-point path against the original double arithmetic for
+// all unit pairs, all densities and a set of typical quantities. This uses
+// floating point, so targets without an FPU should build with
+// -DKITCHENCONV_NO_ACCURACY_REPORT.
+int accuracy_report() {
+    const char* quantities[] = {
+        "1/8", "1/3", "3/4", "1", "2.5", "12", "0.333", "5e-2", "250", "1e3"
+    };
+
+    std::size_t tested = 0, failed = 0;
+    double max_abs = 0, max_rel = 0;
+    std::string worst_abs, worst_rel;
+
+    auto check = [&](const std::string& q, const std::string& from, const std::string& to,
+        const std::string& object, unit uf, unit ut, number density) {
+
+        double dq = 0;
+        auto slash_pos = q.find_first_of("/");
+        if (slash_pos != q.npos) {
+            std::size_t up = 0, low = 0;
+            from_string(q.substr(0, slash_pos), up);
+            from_string(q.substr(slash_pos+1), low);
+            dq = double(up)/double(low);
+        } else {
+            from_string(q, dq);
+        }
+
+        double df = uf.to_si*1e-9, dt = ut.to_si*1e-9;
+        if (density != 0) {
+            if (uf.type == unit_type::volume) {
+                df *= density*1e-6;
+                uf.to_si = apply_density(uf.to_si, density);
+            } else {
+                dt *= density*1e-6;
+                ut.to_si = apply_density(ut.to_si, density);
+            }
+        }
+
+        double expected = 0;
+        if (uf.type == unit_type::temperature) {
+            if (uf.to_si == ut.to_si) {
+                expected = dq;
+            } else if (uf.to_si) {
+                expected = (9.0/5.0)*dq + 32.0;
+            } else {
+                expected = (5.0/9.0)*(dq - 32.0);
+            }
+        } else {
+            expected = dq*df/dt;
+        }
+
+        ++tested;
+        number fq = 0, result = 0;
+        if (!parse_quantity(q, fq) || !convert(fq, uf, ut, result)) {
+            ++failed;
+            std::cout << "  failed: " << q << " " << from << object << " to " << to << std::endl;
+            return;
+        }
+
+        double got = result*1e-6;
+        double abs_err = std::abs(got - expected);
+        double rel_err = expected != 0 ? abs_err/std::abs(expected) : abs_err;
+        std::string name = q + " " + from + object + " to " + to;
+        if (abs_err > max_abs) {
+            max_abs = abs_err;
+            worst_abs = name;
+        }
+        // Results below 1/1000 of a unit are dominated by the fixed resolution
+        if (std::abs(expected) >= 1e-3 && rel_err > max_rel) {
+            max_rel = rel_err;
+            worst_rel = name;
+        }
+    };
+
+    for (auto& q : quantities) {
+        for (auto& f : unit_table) {
+            for (auto& t : unit_table) {
+                const unit& uf = f.second;
+                const unit& ut = t.second;
+                if (uf.type == ut.type) {
+                    check(q, f.first, t.first, "", uf, ut, 0);
+                } else if (uf.type != unit_type::temperature && ut.type != unit_type::temperature) {
+                    for (auto& d : density_table) {
+                        check(q, f.first, t.first, " of " + d.first, uf, ut, d.second);
+                    }
+                }
+            }
+        }
+    }
+
+    std::cout << "fixed-point accuracy against double arithmetic" << std::endl;
+    std::cout << "  conversions tested: " << tested << " (" << failed << " failed)" << std::endl;
+    std::cout << "  max absolute error: " << max_abs << " (" << worst_abs << ")" << std::endl;
+    std::cout << "  max relative error: " << max_rel << " (" << worst_rel << ")" << std::endl;
+    std::cout << "  (results below 0.001 excluded from the relative error)" << std::endl;
+
+    return failed == 0 ? 0 : 1;
+}
+#endif
+
+// Reads CPU counters around each stage of the conversion (--perf-counters).
+// Hardware counters are used when the kernel allows it; otherwise (VMs,
+// restrictive perf_event_paranoid) we fall back to software counters.
+//
+// The counters are opened as one group which keeps counting: switching
+// stages is a single read() of the whole group, and the counts since the
+// previous read go to the stage which just ended.
+struct perf_stages {
+    struct counter {
+        std::string name;
+        int fd;
+    };
+
+    struct stage {
+        std::string name;
+        std::vector<std::uint64_t> values;
+    };
+
+    std::vector<counter> counters;
+    std::vector<stage> stages;
+    std::size_t current = -1;
+    bool report_at_exit = true;
+
+    // Group reads ({nr, time_enabled, time_running, values...}) at the
+    // previous switch and at this one
+    std::vector<std::uint64_t> last, now;
+    // Counts of one switch, subtracted from each stage
+    std::vector<std::uint64_t> overhead;
+
+    perf_stages() = default;
+    perf_stages(const perf_stages&) = delete;
+    perf_stages& operator=(const perf_stages&) = delete;
+
+    ~perf_stages() {
+        end();
+        if (report_at_exit) report();
+#ifdef __linux__
+        // Siblings first, the group leader last
+        for (std::size_t i = counters.size(); i-- > 0;) {
+            if (counters[i].fd >= 0) close(counters[i].fd);
+        }
+#endif
+    }
+
+    // Counters only count the thread which opened them
+    bool open(bool notes = true) {
+#ifdef __linux__
+        auto open_counter = [&](const char* name, std::uint32_t type, std::uint64_t config) {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = type;
+            attr.config = config;
+            attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            // The leader starts the whole group
+            attr.disabled = counters.empty();
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+
+            int leader = counters.empty() ? -1 : counters[0].fd;
+            int fd = syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0);
+            if (fd >= 0) {
+                counters.push_back(counter{name, fd});
+            }
+        };
+
+        open_counter("instructions",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+        open_counter("cycles",        PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+        open_counter("branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+        open_counter("cache-misses",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+
+        if (counters.empty()) {
+            if (notes) std::cerr << "note: hardware counters unavailable, using software counters" << std::endl;
+            open_counter("task-clock-ns", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK);
+            open_counter("page-faults",   PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS);
+            open_counter("ctx-switches",  PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES);
+        }
+
+        if (!counters.empty()) {
+            last.assign(3 + counters.size(), 0);
+            now.assign(3 + counters.size(), 0);
+            overhead.assign(counters.size(), 0);
+
+            ioctl(counters[0].fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ioctl(counters[0].fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+
+            // The cheapest of a few back-to-back reads is what a switch
+            // adds to each stage
+            if (read_group(last)) {
+                overhead.assign(counters.size(), std::uint64_t(-1));
+                for (int k = 0; k < 16 && read_group(now); ++k) {
+                    for (std::size_t i = 0; i < counters.size(); ++i) {
+                        overhead[i] = std::min(overhead[i], now[3 + i] - last[3 + i]);
+                    }
+                    last.swap(now);
+                }
+                if (overhead[0] == std::uint64_t(-1)) overhead.assign(counters.size(), 0);
+            }
+        }
+#endif
+
+        if (counters.empty()) {
+            if (notes) std::cerr << "error: no performance counter available" << std::endl;
+            return false;
+        }
+
+        return true;
+    }
+
+    void begin(const std::string& name) {
+        if (counters.empty()) return;
+        switch_to(find_stage(name));
+    }
+
+    void end() {
+        if (current == std::size_t(-1)) return;
+        switch_to(-1);
+    }
+
+    // Adds the counts of the same counters opened in another thread
+    void merge(const perf_stages& p) {
+        if (counters.empty()) {
+            for (auto& c : p.counters) {
+                counters.push_back(counter{c.name, -1});
+            }
+        }
+
+        if (counters.size() != p.counters.size()) return;
+
+        for (auto& s : p.stages) {
+            stage& t = stages[find_stage(s.name)];
+            for (std::size_t i = 0; i < counters.size(); ++i) {
+                t.values[i] += s.values[i];
+            }
+        }
+    }
+
+    // Reports the counts per item (line or ingredient) and per MB of input,
+    // for batch runs
+    void report(std::uint64_t items, const char* item, std::uint64_t bytes) const {
+        if (stages.empty()) return;
+
+        // In tenths, as v*scale/n without overflowing for large counts
+        auto rate = [](std::uint64_t v, std::uint64_t n, std::uint64_t scale) {
+            if (n == 0) return std::string("-");
+            std::uint64_t tenths = v/n*scale*10 + v%n*scale*10/n;
+            return std::to_string(tenths/10) + "." + std::to_string(tenths%10);
+        };
+
+        auto table = [&](const char* title, std::uint64_t n, std::uint64_t scale) {
+            std::cerr << "perf: " << std::setw(10) << std::left << title;
+            for (auto& c : counters) {
+                std::cerr << std::setw(15) << std::right << c.name;
+            }
+            std::cerr << std::endl;
+
+            for (auto& s : stages) {
+                std::cerr << "perf: " << std::setw(10) << std::left << s.name;
+                for (auto v : s.values) {
+                    std::cerr << std::setw(15) << std::right << rate(v, n, scale);
+                }
+                std::cerr << std::endl;
+            }
+        };
+
+        table(item, items, 1);
+        table("per MB", bytes, 1000000);
+    }
+
+    void report() const {
+        if (stages.empty()) return;
+
+        // Only one line is converted per run, so the counts are per-line rates
+        std::cerr << "perf: " << std::setw(10) << std::left << "stage";
+        for (auto& c : counters) {
+            std::cerr << std::setw(15) << std::right << c.name;
+        }
+        std::cerr << std::endl;
+
+        for (auto& s : stages) {
+            std::cerr << "perf: " << std::setw(10) << std::left << s.name;
+            for (auto v : s.values) {
+                std::cerr << std::setw(15) << std::right << v;
+            }
+            std::cerr << std::endl;
+        }
+    }
+
+private:
+    // Adds the counts since the previous switch to the current stage, and
+    // makes `next` current
+    void switch_to(std::size_t next) {
+#ifdef __linux__
+        if (!read_group(now)) {
+            current = -1;
+            return;
+        }
+
+        if (current != std::size_t(-1)) {
+            std::uint64_t enabled = now[1] - last[1];
+            std::uint64_t running = now[2] - last[2];
+            // The kernel multiplexed the group with other events: scale the
+            // counts up to the whole time it was enabled. Both times are
+            // halved to keep v%running*enabled within 64 bits.
+            bool scale = running != 0 && running < enabled;
+            while (scale && enabled >> 32) {
+                enabled >>= 1;
+                running >>= 1;
+            }
+            if (running == 0) scale = false;
+
+            for (std::size_t i = 0; i < counters.size(); ++i) {
+                std::uint64_t v = now[3 + i] - last[3 + i];
+                v = v > overhead[i] ? v - overhead[i] : 0;
+                if (scale) v = v/running*enabled + v%running*enabled/running;
+                stages[current].values[i] += v;
+            }
+        }
+
+        last.swap(now);
+#endif
+        current = next;
+    }
+
+#ifdef __linux__
+    bool read_group(std::vector<std::uint64_t>& v) {
+        ssize_t size = v.size()*sizeof(v[0]);
+        return read(counters[0].fd, v.data(), size) == size && v[0] == counters.size();
+    }
+#endif
+
+    std::size_t find_stage(const std::string& name) {
+        auto iter = std::find_if(stages.begin(), stages.end(),
+            [&](const stage& s) { return s.name == name; });
+        if (iter == stages.end()) {
+            stages.push_back(stage{name, std::vector<std::uint64_t>(counters.size())});
+            iter = stages.end() - 1;
+        }
+
+        return iter - stages.begin();
+    }
+};
+
+// Converts one request, given as separate words ("3/4", "cup", "to", "ml").
+// On success the result is written to 'out' and true is returned; otherwise
+// the error is written to 'err', followed by suggestions if 'notes' is set.
+bool convert_request(const std::vector<std::string>& words, std::ostream& out,
+    std::ostream& err, bool notes, perf_stages& perf) {
+
+    perf.begin("parse");
+
+    if (words.size() < 4) {
+        KC_PROBE1(error_raised, "syntax");
+        err << "syntax error: expected "
+            "'<quantity> <unit> [material] to <unit> [material]" << std::endl;
+        return false;
     }
 
     std::string quantity, unit_from, object_from, unit_to, object_to;
     bool to_found = false;
-    for (int i = 1; i < argc; ++i) {
-        if (tolower(argv[i]) == "to" || tolower(argv[i]) == "in") {
+    for (auto& arg : words) {
+        if (tolower(arg) == "to" || tolower(arg) == "in") {
             if (to_found) {
-                std::cerr << "syntax error: multiple 'to' or 'in' not allowed" << std::endl;
-                return 1;
+                KC_PROBE1(error_raised, "syntax");
+                err << "syntax error: multiple 'to' or 'in' not allowed" << std::endl;
+                return false;
             }
 
             to_found = true;
         } else if (quantity.empty()) {
-            quantity = tolower(argv[i]);
+            quantity = tolower(arg);
         } else if (unit_from.empty()) {
-            unit_from = tolower(argv[i]);
+            unit_from = tolower(arg);
         } else if (!to_found && object_from.empty()) {
-            if (tolower(argv[i]) != "of") {
-                object_from = tolower(argv[i]);
+            if (tolower(arg) != "of") {
+                object_from = tolower(arg);
             }
         } else if (to_found && unit_to.empty()) {
-            unit_to = tolower(argv[i]);
+            unit_to = tolower(arg);
         } else if (to_found && object_to.empty()) {
-            if (tolower(argv[i]) != "of") {
-                object_to = tolower(argv[i]);
+            if (tolower(arg) != "of") {
+                object_to = tolower(arg);
             }
         } else {
-            std::cerr << "syntax error: expected "
+            KC_PROBE1(error_raised, "syntax");
+            err << "syntax error: expected "
                 "'<quantity> <unit> [material] to <unit> [material]" << std::endl;
-            return 1;
+            return false;
         }
     }
 
     if (!object_from.empty() && !object_to.empty() && object_to != object_from) {
-        std::cerr << "error: cannot convert a quantity of '"
+        KC_PROBE1(error_raised, "substance_mismatch");
+        err << "error: cannot convert a quantity of '"
             << object_from << "' into one of '" << object_to << "'" << std::endl;
-        return 1;
+        return false;
     }
 
     std::string object = object_from.empty() ? object_to : object_from;
+    KC_PROBE3(request_parsed, quantity.c_str(), unit_from.c_str(), unit_to.c_str());
 
+    perf.begin("lookup");
     unit uf, ut;
-    if (!make_unit(uf, unit_from)) return 1;
-    if (!make_unit(ut, unit_to))   return 1;
-
-    double quantity_float; {
-        auto slash_pos = quantity.find_first_of("/");
-        if (slash_pos != quantity.npos) {
-            std::string frac_up = quantity.substr(0, slash_pos);
-            std::string frac_low = quantity.substr(slash_pos+1);
-
-            std::size_t up = 0, low = 0;
-            if (!from_string(frac_up, up) || !from_string(frac_low, low)) {
-                std::cerr << "error: could not convert '" << quantity
-                    << "' into a number" << std::endl;
-                return 1;
-            }
+    if (!make_unit(uf, unit_from, err, notes)) return false;
+    if (!make_unit(ut, unit_to, err, notes)) return false;
 
-            quantity_float = double(up)/double(low);
-        } else {
-            if (!from_string(quantity, quantity_float)) {
-                std::cerr << "error: could not convert '" << quantity
-                    << "' into a number" << std::endl;
-                return 1;
-            }
-        }
+    perf.begin("parse");
+    number quantity_value;
+    if (!parse_quantity(quantity, quantity_value)) {
+        KC_PROBE1(error_raised, "bad_number");
+        err << "error: could not convert '" << quantity
+            << "' into a number" << std::endl;
+        return false;
     }
 
+    perf.begin("lookup");
     if ((uf.type == unit_type::weight && ut.type == unit_type::volume) ||
         (uf.type == unit_type::volume && ut.type == unit_type::weight)) {
         if (object.empty()) {
-            std::cerr << "error: converting '" << unit_from << "' (a " <<
+            KC_PROBE1(error_raised, "missing_substance");
+            err << "error: converting '" << unit_from << "' (a " <<
                 unit_type_name(uf.type) << ") into '" << unit_to << "' (a " <<
                 unit_type_name(ut.type) << ") requires knowing the substance "
                 "which is converted" << std::endl;
-            return 1;
+            return false;
         }
 
         auto iter = density_table.find(object);
+        KC_PROBE2(density_resolved, object.c_str(), int(iter != density_table.end()));
         if (iter == density_table.end()) {
-            std::cerr << "error: the density of '" << object << "' is unknown" << std::endl;
-            std::cerr << "note: known densities: ";
-            std::vector<std::string> densities;
-            densities.reserve(density_table.size());
-            for (auto& v : density_table) {
-                densities.push_back(v.first);
+            KC_PROBE1(error_raised, "unknown_density");
+            err << "error: the density of '" << object << "' is unknown" << std::endl;
+            if (notes) {
+                err << "note: known densities: ";
+                std::vector<std::string> densities;
+                densities.reserve(density_table.size());
+                for (auto& v : density_table) {
+                    densities.push_back(v.first);
+                }
+
+                sort_and_print(err, std::move(densities), object);
             }
 
-            sort_and_cerr(std::move(densities), object);
-            return 1;
+            return false;
         }
 
-        double density_si = iter->second; // kg/L
+        number density_si = iter->second; // kg/L
         if (uf.type == unit_type::volume) {
             uf.type = unit_type::weight;
-            uf.to_si *= density_si;
+            uf.to_si = apply_density(uf.to_si, density_si);
         } else if (ut.type == unit_type::volume) {
             ut.type = unit_type::weight;
-            ut.to_si *= density_si;
+            ut.to_si = apply_density(ut.to_si, density_si);
         }
     }
 
     if (uf.type != ut.type) {
-        std::cerr << "error: cannot convert from '" << unit_from << "' (a " <<
+        KC_PROBE1(error_raised, "incompatible_units");
+        err << "error: cannot convert from '" << unit_from << "' (a " <<
             unit_type_name(uf.type) << ") into '" << unit_to << "' (a " <<
             unit_type_name(ut.type) << ")" << std::endl;
-        return 1;
+        return false;
     }
 
-    double result = 0;
-    if (uf.type == unit_type::temperature) {
-        if (uf.to_si == ut.to_si) {
-            result = quantity_float;
-        } else if (uf.to_si) {
-            // Celcius to Fahrenheit
-            result = (9.0/5.0)*quantity_float + 32.0;
-        } else {
-            // Fahrenheit to Celcius
-            result = (5.0/9.0)*(quantity_float - 32.0);
-        }
-    } else {
-        result = quantity_float*uf.to_si/ut.to_si;
+    perf.begin("convert");
+    number result = 0;
+    if (!convert(quantity_value, uf, ut, result)) {
+        KC_PROBE1(error_raised, "overflow");
+        err << "error: '" << quantity << "' is too large to be converted" << std::endl;
+        return false;
     }
 
-    std::cout << "  " << quantity << " " << unit_from << (object.empty() ? "" : " of "+object)
-              << " is " << result << " " << unit_to << std::endl;
+    KC_PROBE3(conversion_done, unit_from.c_str(), unit_to.c_str(), object.c_str());
+
+    perf.begin("output");
+    out << quantity << " " << unit_from << (object.empty() ? "" : " of "+object)
+        << " is " << format_number(result) << " " << unit_to;
+
+    return true;
+}
+
+// Free-form ingredients, as found in recipes ("1 1/2 cups flour, sifted"), are
+// parsed into a quantity, a unit and a substance when a known one is named,
+// and normalized to grams (weights, and volumes of known substances) or to
+// milliliters (other volumes).
+struct ingredient {
+    number quantity = 0;
+    std::string unit;
+    std::string substance;
+    std::string source_unit;
+};
+
+bool parse_ingredient(const std::string& text, ingredient& ing, std::string& error) {
+    // Spell out unicode fractions, so that "1½" reads as "1 1/2"
+    static const char* fractions[][2] = {
+        {"¼", " 1/4 "}, {"½", " 1/2 "}, {"¾", " 3/4 "},
+        {"⅓", " 1/3 "}, {"⅔", " 2/3 "}, {"⅛", " 1/8 "}
+    };
+
+    std::string s = text;
+    for (auto& f : fractions) {
+        std::size_t pos = 0;
+        while ((pos = s.find(f[0], pos)) != s.npos) {
+            s.replace(pos, std::strlen(f[0]), f[1]);
+        }
+    }
+
+    std::vector<std::string> words;
+    std::istringstream ss(s);
+    std::string word;
+    while (ss >> word) {
+        word = tolower(word);
+        word.erase(0, word.find_first_not_of("("));
+        word.erase(word.find_last_not_of(",.;:)") + 1);
+        if (!word.empty()) words.push_back(word);
+    }
+
+    // Quantities glued to their unit: "250g"
+    if (!words.empty()) {
+        std::size_t split = words[0].find_first_not_of("0123456789./");
+        if (split != 0 && split != std::string::npos && unit_table.count(words[0].substr(split))) {
+            words.insert(words.begin() + 1, words[0].substr(split));
+            words[0].erase(split);
+        }
+    }
+
+    number quantity;
+    if (words.empty() || !parse_quantity(words[0], quantity)) {
+        KC_PROBE1(error_raised, "bad_number");
+        error = "no quantity";
+        return false;
+    }
+
+    // Mixed numbers: "1 1/2"
+    std::size_t i = 1;
+    number fraction;
+    if (i < words.size() && words[i].find('/') != std::string::npos &&
+        parse_quantity(words[i], fraction)) {
+#ifdef KITCHENCONV_FIXED_POINT
+        if (fraction > 0 ? quantity > INT64_MAX - fraction : quantity < INT64_MIN - fraction) {
+            KC_PROBE1(error_raised, "overflow");
+            error = "quantity too large";
+            return false;
+        }
+#endif
+        quantity += fraction;
+        ++i;
+    }
+
+    if (i == words.size()) {
+        KC_PROBE1(error_raised, "syntax");
+        error = "no unit";
+        return false;
+    }
+
+    auto iter = unit_table.find(words[i]);
+    KC_PROBE2(unit_resolved, words[i].c_str(), int(iter != unit_table.end()));
+    if (iter == unit_table.end()) {
+        KC_PROBE1(error_raised, "unknown_unit");
+        error = "unknown unit '" + words[i] + "'";
+        return false;
+    }
+
+    ing.source_unit = iter->first;
+    unit uf = iter->second;
+    if (uf.type == unit_type::temperature) {
+        KC_PROBE1(error_raised, "incompatible_units");
+        error = "a temperature is not an amount";
+        return false;
+    }
+
+    // Find the substance, trying two-word names first ("baking powder")
+    ing.substance.clear();
+    for (++i; i < words.size() && ing.substance.empty(); ++i) {
+        if (i+1 < words.size() && density_table.count(words[i] + "-" + words[i+1])) {
+            ing.substance = words[i] + "-" + words[i+1];
+        } else if (density_table.count(words[i])) {
+            ing.substance = words[i];
+        }
+    }
+
+    ing.unit = "g";
+    if (uf.type == unit_type::volume) {
+        // Volumes are left in ml when no density is known, which is not an error
+        KC_PROBE2(density_resolved, ing.substance.c_str(), int(!ing.substance.empty()));
+        if (ing.substance.empty()) {
+            ing.unit = "ml";
+        } else {
+            uf.type = unit_type::weight;
+            uf.to_si = apply_density(uf.to_si, density_table.at(ing.substance));
+        }
+    }
+
+    if (!convert(quantity, uf, unit_table.at(ing.unit), ing.quantity)) {
+        KC_PROBE1(error_raised, "overflow");
+        error = "quantity too large";
+        return false;
+    }
+
+#ifndef KITCHENCONV_FIXED_POINT
+    if (!std::isfinite(ing.quantity)) {
+        KC_PROBE1(error_raised, "bad_number");
+        error = "quantity is not a number";
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+// Linting
+// =======
+//
+// --lint parses each line of the batch inputs as an ingredient, without
+// writing any output, and reports how many lines could not be understood
+// and how the normalized quantity of each ingredient is distributed. The
+// distributions are kept in histograms with logarithmic bins 2% wide, so
+// the memory used does not depend on the size of the corpus, quantiles are
+// accurate to about 1%, and the histograms of each thread are merged by
+// adding their bins. The largest values of each ingredient are kept, and
+// reported as outliers when they exceed 20 times the median.
+
+// Bins grow by 2% (b/50), which works on fixed-point numbers too, so that
+// the fixed-point build stays free of floating point
+const number sketch_min_value = KC_AMOUNT(0.001);
+const std::size_t sketch_bin_count = 1200; // up to 1e-3*1.02^1200 ~ 2e7
+
+// Lower bound of each bin, computed once so that adding a value is a binary search
+const std::vector<number>& sketch_bounds() {
+    static const std::vector<number> bounds = [] {
+        std::vector<number> b(sketch_bin_count);
+        b[0] = 0;
+        number v = sketch_min_value;
+        for (std::size_t i = 1; i < sketch_bin_count; ++i) {
+            b[i] = v;
+            v += v/50;
+        }
+
+        return b;
+    }();
+
+    return bounds;
+}
+
+struct quantity_sketch {
+    std::vector<std::uint64_t> bins = std::vector<std::uint64_t>(sketch_bin_count);
+    std::uint64_t count = 0;
+
+    void add(number v) {
+        const std::vector<number>& bounds = sketch_bounds();
+        std::size_t bin = std::upper_bound(bounds.begin(), bounds.end(), v) - bounds.begin();
+        ++bins[bin == 0 ? 0 : bin - 1];
+        ++count;
+    }
+
+    void merge(const quantity_sketch& s) {
+        for (std::size_t i = 0; i < sketch_bin_count; ++i) {
+            bins[i] += s.bins[i];
+        }
+
+        count += s.count;
+    }
+
+    // Middle of the bin holding the given quantile, in thousandths
+    number quantile(std::uint64_t permille) const {
+        std::uint64_t rank = permille*(count - 1)/1000;
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < sketch_bin_count; ++i) {
+            seen += bins[i];
+            if (seen > rank) {
+                return i == 0 ? 0 : sketch_bounds()[i] + sketch_bounds()[i]/100;
+            }
+        }
+
+        return 0;
+    }
+};
+
+struct lint_ingredient {
+    quantity_sketch sketch;
+    std::map<std::string, std::uint64_t> units;
+    std::vector<std::pair<number, std::string>> largest;
+
+    static const std::size_t max_largest = 5;
+
+    void add_largest(number v, const std::string& line) {
+        if (largest.size() == max_largest && v <= largest.back().first) return;
+        for (auto& l : largest) {
+            if (l.second == line) return;
+        }
+
+        largest.emplace_back(v, line);
+        std::sort(largest.begin(), largest.end(),
+            [](const std::pair<number, std::string>& p1, const std::pair<number, std::string>& p2) {
+                return p1.first > p2.first;
+            }
+        );
+
+        if (largest.size() > max_largest) largest.pop_back();
+    }
+};
+
+struct lint_stats {
+    std::uint64_t lines = 0;
+    std::uint64_t failed = 0;
+    std::map<std::string, std::uint64_t> errors;
+    std::map<std::string, lint_ingredient> ingredients;
+
+    void merge(const lint_stats& s) {
+        lines += s.lines;
+        failed += s.failed;
+        for (auto& e : s.errors) {
+            errors[e.first] += e.second;
+        }
+
+        for (auto& i : s.ingredients) {
+            lint_ingredient& li = ingredients[i.first];
+            li.sketch.merge(i.second.sketch);
+            for (auto& u : i.second.units) {
+                li.units[u.first] += u.second;
+            }
+
+            for (auto& l : i.second.largest) {
+                li.add_largest(l.first, l.second);
+            }
+        }
+    }
+};
+
+void lint_batch_chunk(const std::string& chunk, lint_stats& stats) {
+    ingredient ing;
+    std::string error;
+    std::size_t pos = 0;
+    while (pos < chunk.size()) {
+        std::size_t end = chunk.find('\n', pos);
+        if (end == chunk.npos) end = chunk.size();
+
+        std::string line = chunk.substr(pos, end - pos);
+        pos = end + 1;
+
+        if (line.find_first_not_of(" \t\r") == line.npos) continue;
+        ++stats.lines;
+
+        if (!parse_ingredient(line, ing, error)) {
+            // Group errors by kind, without the word which caused them
+            ++stats.failed;
+            ++stats.errors[error.substr(0, error.find(" '"))];
+            continue;
+        }
+
+        std::string key = (ing.substance.empty() ? "other" : ing.substance) + " (" + ing.unit + ")";
+        lint_ingredient& li = stats.ingredients[key];
+        li.sketch.add(ing.quantity);
+        ++li.units[ing.source_unit];
+        li.add_largest(ing.quantity, line);
+    }
+}
+
+void print_lint_report(const lint_stats& stats) {
+    auto percent = [](std::uint64_t n, std::uint64_t total) {
+        std::uint64_t tenths = total == 0 ? 0 : 1000*n/total;
+        return std::to_string(tenths/10) + "." + std::to_string(tenths%10) + "%";
+    };
+
+    std::cout << "lines: " << stats.lines << ", not understood: " << stats.failed
+        << " (" << percent(stats.failed, stats.lines) << ")" << std::endl;
+    for (auto& e : stats.errors) {
+        std::cout << "  " << e.first << ": " << e.second << " ("
+            << percent(e.second, stats.lines) << ")" << std::endl;
+    }
+
+    std::cout << std::endl << std::left << std::setw(24) << "ingredient" << std::right
+        << std::setw(12) << "lines" << std::setw(12) << "median" << std::setw(12) << "p90"
+        << std::setw(12) << "p99" << std::setw(12) << "max" << std::endl;
+    for (auto& i : stats.ingredients) {
+        const lint_ingredient& li = i.second;
+        number max = li.largest.front().first;
+        std::cout << std::left << std::setw(24) << i.first << std::right
+            << std::setw(12) << li.sketch.count
+            << std::setw(12) << format_number(std::min(li.sketch.quantile(500), max))
+            << std::setw(12) << format_number(std::min(li.sketch.quantile(900), max))
+            << std::setw(12) << format_number(std::min(li.sketch.quantile(990), max))
+            << std::setw(12) << format_number(max) << std::endl;
+    }
+
+    std::cout << std::endl << "outliers (more than 20 times the median):" << std::endl;
+    for (auto& i : stats.ingredients) {
+        number median = i.second.sketch.quantile(500);
+        for (auto& l : i.second.largest) {
+            if (l.first > 20*median) {
+                std::cout << "  " << i.first << ": " << format_number(l.first)
+                    << " for '" << l.second << "' (median " << format_number(median) << ")" << std::endl;
+            }
+        }
+    }
+
+    std::cout << std::endl << "rare units (under 1% of the lines of an ingredient):" << std::endl;
+    for (auto& i : stats.ingredients) {
+        for (auto& u : i.second.units) {
+            if (100*u.second < i.second.sketch.count) {
+                std::cout << "  " << i.first << ": " << u.first << " (" << u.second
+                    << " line(s))" << std::endl;
+            }
+        }
+    }
+}
+
+#ifdef KITCHENCONV_WITH_ZLIB
+// Decompresses a gzip stream on the fly, including files made of several
+// concatenated gzip members. Anything after the last member that does not
+// start like a gzip member (such as zero padding) ends the stream, and is
+// reported by trailing_garbage(). Corrupted or truncated input also ends the
+// stream, after all the data inflated so far, and is reported by error():
+// throwing from underflow() would lose that data, since std::istream::read()
+// does not count what it got before the exception.
+class gzip_istreambuf : public std::streambuf {
+public:
+    explicit gzip_istreambuf(std::istream& in) : in_(in) {
+        std::memset(&z_, 0, sizeof(z_));
+        if (inflateInit2(&z_, 15 + 16) != Z_OK) {
+            throw std::runtime_error("could not initialize zlib");
+        }
+    }
+
+    ~gzip_istreambuf() {
+        inflateEnd(&z_);
+    }
+
+    const std::string& error() const { return error_; }
+    bool trailing_garbage() const { return trailing_garbage_; }
+
+protected:
+    int_type underflow() override {
+        if (done_) return traits_type::eof();
+
+        while (true) {
+            if (member_end_) {
+                // Another member follows only if it starts with the gzip magic
+                fill_input(2);
+                if (z_.avail_in == 0) return end();
+                if (z_.avail_in < 2 || z_.next_in[0] != 0x1f || z_.next_in[1] != 0x8b) {
+                    trailing_garbage_ = true;
+                    return end();
+                }
+
+                inflateReset(&z_);
+                member_end_ = false;
+            }
+
+            if (z_.avail_in == 0) {
+                fill_input(1);
+                if (z_.avail_in == 0) return end("truncated gzip stream");
+            }
+
+            z_.next_out = reinterpret_cast<Bytef*>(out_buffer_);
+            z_.avail_out = sizeof(out_buffer_);
+            int ret = inflate(&z_, Z_NO_FLUSH);
+            if (ret == Z_STREAM_END) {
+                member_end_ = true;
+            } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                error_ = "corrupted gzip stream";
+            }
+
+            std::size_t n = sizeof(out_buffer_) - z_.avail_out;
+            if (n != 0) {
+                setg(out_buffer_, out_buffer_, out_buffer_ + n);
+                return traits_type::to_int_type(*gptr());
+            } else if (!error_.empty()) {
+                return end(error_);
+            }
+        }
+    }
+
+private:
+    // Reads more input, until at least n bytes are available or the input ends
+    void fill_input(std::size_t n) {
+        if (!error_.empty()) return;
+
+        if (z_.avail_in != 0) std::memmove(in_buffer_, z_.next_in, z_.avail_in);
+        z_.next_in = reinterpret_cast<Bytef*>(in_buffer_);
+        while (z_.avail_in < n && in_) {
+            in_.read(in_buffer_ + z_.avail_in, sizeof(in_buffer_) - z_.avail_in);
+            z_.avail_in += in_.gcount();
+        }
+    }
+
+    int_type end(const std::string& error = "") {
+        if (error_.empty()) error_ = error;
+        done_ = true;
+        return traits_type::eof();
+    }
+
+    std::istream& in_;
+    z_stream z_;
+    bool member_end_ = false;
+    bool done_ = false;
+    bool trailing_garbage_ = false;
+    std::string error_;
+    char in_buffer_[64*1024];
+    char out_buffer_[256*1024];
+};
+
+// Compresses everything written to it into a gzip stream; close() must be
+// called to write the end of the stream.
+class gzip_ostreambuf : public std::streambuf {
+public:
+    gzip_ostreambuf(std::ostream& out, int level) : out_(out) {
+        std::memset(&z_, 0, sizeof(z_));
+        if (deflateInit2(&z_, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            throw std::runtime_error("could not initialize zlib");
+        }
+
+        setp(in_buffer_, in_buffer_ + sizeof(in_buffer_));
+    }
+
+    ~gzip_ostreambuf() {
+        deflateEnd(&z_);
+    }
+
+    bool close() {
+        if (closed_) return true;
+        closed_ = true;
+        return compress(Z_FINISH) && out_.flush();
+    }
+
+protected:
+    int_type overflow(int_type c) override {
+        if (!compress(Z_NO_FLUSH)) return traits_type::eof();
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+
+        return traits_type::not_eof(c);
+    }
+
+    int sync() override {
+        return closed_ || compress(Z_NO_FLUSH) ? 0 : -1;
+    }
+
+private:
+    bool compress(int flush) {
+        z_.next_in = reinterpret_cast<Bytef*>(pbase());
+        z_.avail_in = pptr() - pbase();
+
+        int ret = Z_OK;
+        do {
+            z_.next_out = reinterpret_cast<Bytef*>(out_buffer_);
+            z_.avail_out = sizeof(out_buffer_);
+            ret = deflate(&z_, flush);
+            if (ret == Z_STREAM_ERROR) return false;
+            out_.write(out_buffer_, sizeof(out_buffer_) - z_.avail_out);
+        } while (z_.avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+
+        setp(in_buffer_, in_buffer_ + sizeof(in_buffer_));
+        return bool(out_);
+    }
+
+    std::ostream& out_;
+    z_stream z_;
+    bool closed_ = false;
+    char in_buffer_[256*1024];
+    char out_buffer_[64*1024];
+};
+
+class gzip_istream : public std::istream {
+public:
+    explicit gzip_istream(std::istream& in) : std::istream(nullptr), buffer_(in) {
+        rdbuf(&buffer_);
+    }
+
+    const std::string& error() const { return buffer_.error(); }
+    bool trailing_garbage() const { return buffer_.trailing_garbage(); }
+
+private:
+    gzip_istreambuf buffer_;
+};
+
+class gzip_ostream : public std::ostream {
+public:
+    gzip_ostream(std::ostream& out, int level) : std::ostream(nullptr), buffer_(out, level) {
+        rdbuf(&buffer_);
+    }
+
+    void close() {
+        if (!buffer_.close()) setstate(std::ios::badbit);
+    }
+
+private:
+    gzip_ostreambuf buffer_;
+};
+#endif
+
+// Batch mode
+// ==========
+//
+// Each input file holds one request per line, in the same syntax as the
+// command line, and gets one output line per input line: either the result
+// or the error. Files are cut into chunks of whole lines, which worker
+// threads take from the largest file first, so that a huge file is shared by
+// all the workers instead of keeping one of them busy while the others are
+// idle. Chunks are written back in order, to '<file>.out' (or to the
+// standard output when reading the standard input, '-').
+//
+// Gzip-compressed input (detected from its header) is decompressed while
+// reading when built with zlib, and the output is then compressed as well,
+// to '<file without .gz>.out.gz'. The gzip level (1 to 9) can be set, which
+// also compresses the output of uncompressed files; level 0 never
+// compresses.
+//
+// Tar archives (also gzip-compressed) are read member by member without
+// extracting them: chunks never span two members, and all members go to a
+// single output, each line prefixed with the name of its member.
+
+// Limits of -j and --chunk-size, well above any useful value
+const std::size_t max_batch_jobs = 1024;
+const std::size_t max_chunk_kib = 1024*1024;
+
+// Only regular files are probed (several bytes read, then rewound) and
+// opened more than once. Anything else that can be read, such as a FIFO or
+// a process substitution, is a stream read once from the start, like the
+// standard input ('-').
+enum class input_type {
+    missing,
+    regular,
+    directory,
+    stream
+};
+
+input_type stat_input(const std::string& path, std::uint64_t& size) {
+    size = 0;
+    if (path == "-") return input_type::stream;
+
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return input_type::missing;
+
+    if ((st.st_mode & S_IFMT) == S_IFDIR) {
+        return input_type::directory;
+    } else if ((st.st_mode & S_IFMT) == S_IFREG) {
+        size = st.st_size;
+        return input_type::regular;
+    }
+
+    return input_type::stream;
+}
+
+struct batch_file {
+    std::string input_path, output_path;
+    std::uint64_t size = 0;
+    input_type type = input_type::missing;
+
+    std::mutex mutex;
+    std::istream* in = nullptr;
+    std::ostream* out = nullptr;
+    std::unique_ptr<std::ifstream> in_file;
+    std::unique_ptr<std::ofstream> out_file;
+#ifdef KITCHENCONV_WITH_ZLIB
+    std::unique_ptr<gzip_istream> in_gzip;
+    std::unique_ptr<gzip_ostream> out_gzip;
+#endif
+    int gzip_level = -1;
+    bool write_output = true;
+    bool tar = false;
+    std::string tar_member;
+    std::uint64_t tar_remaining = 0;
+    std::uint64_t tar_padding = 0;
+    bool read_done = false;
+    bool finished = false;
+    bool failed = false;
+    std::size_t chunks_read = 0;
+    std::size_t chunks_written = 0;
+    std::map<std::size_t, std::string> pending;
+};
+
+struct batch_stats {
+    std::atomic<std::uint64_t> lines{0};
+    std::atomic<std::uint64_t> bytes{0};
+    std::atomic<std::uint64_t> errors{0};
+    std::atomic<bool> failed{false};
+};
+
+std::mutex batch_cerr_mutex;
+
+void batch_error(batch_file& f, batch_stats& stats, const std::string& message) {
+    std::lock_guard<std::mutex> lock(batch_cerr_mutex);
+    std::cerr << "error: " << message << std::endl;
+    f.failed = true;
+    stats.failed = true;
+}
+
+void batch_warning(const std::string& message) {
+    std::lock_guard<std::mutex> lock(batch_cerr_mutex);
+    std::cerr << "warning: " << message << std::endl;
+}
+
+// Called with the file's mutex held, once everything was read and written.
+void finish_batch_file(batch_file& f, batch_stats& stats) {
+    if (f.finished) return;
+    f.finished = true;
+
+    if (f.out) {
+        f.out->flush();
+#ifdef KITCHENCONV_WITH_ZLIB
+        if (f.out_gzip) f.out_gzip->close();
+#endif
+        bool write_failed = f.out->fail() || (f.out_file && f.out_file->fail());
+        if (write_failed && !f.failed) {
+            batch_error(f, stats, "could not write to '" + f.output_path + "'");
+        }
+    }
+
+#ifdef KITCHENCONV_WITH_ZLIB
+    f.in_gzip.reset();
+    f.out_gzip.reset();
+#endif
+    f.in_file.reset();
+    f.out_file.reset();
+    f.pending.clear();
+}
+
+enum class compression {
+    none,
+    gzip,
+    zstd
+};
+
+// Seekable streams are rewound afterwards; if that fails, failbit is left
+// set and the caller must report a read error.
+compression detect_compression(std::istream& in, bool seekable) {
+    if (!seekable) {
+        // Only one character can be peeked from a pipe; 0x1f is never text
+        return in.peek() == 0x1f ? compression::gzip : compression::none;
+    }
+
+    unsigned char magic[4] = {0, 0, 0, 0};
+    in.read(reinterpret_cast<char*>(magic), sizeof(magic));
+    in.clear();
+    in.seekg(0);
+
+    if (magic[0] == 0x1f && magic[1] == 0x8b) {
+        return compression::gzip;
+    } else if (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) {
+        return compression::zstd;
+    } else {
+        return compression::none;
+    }
+}
+
+enum class archive {
+    none,
+    tar,
+    zip
+};
+
+archive detect_archive(std::istream& in) {
+    char header[512];
+    in.read(header, sizeof(header));
+    std::size_t n = in.gcount();
+    in.clear();
+    in.seekg(0);
+
+    if (n >= 4 && std::string(header, 4) == "PK\x03\x04") {
+        return archive::zip;
+    } else if (n == sizeof(header) && std::string(header + 257, 5) == "ustar") {
+        return archive::tar;
+    } else {
+        return archive::none;
+    }
+}
+
+bool ends_with(const std::string& s, const std::string& suffix) {
+    return s.size() >= suffix.size() &&
+        s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Parses a numeric field of a tar header: octal text, or base-256 binary
+// when the high bit of the first byte is set (GNU, for sizes above 8 GB).
+std::uint64_t tar_number(const char* field, std::size_t size) {
+    std::uint64_t v = 0;
+    if (static_cast<unsigned char>(field[0]) & 0x80) {
+        for (std::size_t i = 1; i < size; ++i) {
+            v = (v << 8) | static_cast<unsigned char>(field[i]);
+        }
+    } else {
+        for (std::size_t i = 0; i < size; ++i) {
+            if (field[i] >= '0' && field[i] <= '7') {
+                v = 8*v + (field[i] - '0');
+            } else if (field[i] != ' ' || v != 0) {
+                break;
+            }
+        }
+    }
+
+    return v;
+}
+
+// Long names and extended headers are read in memory; real ones are a few
+// hundred bytes, so anything larger is taken as corruption
+const std::uint64_t max_tar_record_size = 1024*1024;
+
+std::string tar_string(const char* field, std::size_t size) {
+    return std::string(field, std::find(field, field + size, '\0'));
+}
+
+// Moves to the next regular file with content in the archive, with the
+// file's mutex held. Returns false at the end of the archive or on error.
+bool next_tar_member(batch_file& f, batch_stats& stats) {
+    std::string long_name;
+    while (true) {
+        f.in->ignore(f.tar_padding);
+        f.tar_padding = 0;
+
+        char header[512];
+        f.in->read(header, sizeof(header));
+        if (f.in->gcount() == 0) {
+            return false;
+        } else if (f.in->gcount() != sizeof(header)) {
+            batch_error(f, stats, "truncated tar archive '" + f.input_path + "'");
+            return false;
+        }
+
+        if (std::all_of(header, header + sizeof(header), [](char c) { return c == 0; })) {
+            return false;
+        }
+
+        std::uint64_t checksum = 8*' ';
+        for (std::size_t i = 0; i < sizeof(header); ++i) {
+            if (i < 148 || i >= 156) checksum += static_cast<unsigned char>(header[i]);
+        }
+
+        if (checksum != tar_number(header + 148, 8)) {
+            batch_error(f, stats, "corrupted tar archive '" + f.input_path + "'");
+            return false;
+        }
+
+        std::uint64_t size = tar_number(header + 124, 12);
+        std::uint64_t padding = (512 - size % 512) % 512;
+        char type = header[156];
+
+        if (type == 'L' || type == 'x') {
+            // GNU long name, or POSIX extended header which may hold a path
+            if (size > max_tar_record_size) {
+                batch_error(f, stats, "corrupted tar archive '" + f.input_path + "'");
+                return false;
+            }
+
+            std::string data(size, '\0');
+            f.in->read(&data[0], size);
+            if (std::uint64_t(f.in->gcount()) != size) {
+                batch_error(f, stats, "truncated tar archive '" + f.input_path + "'");
+                return false;
+            }
+
+            if (type == 'L') {
+                long_name = tar_string(data.data(), data.size());
+            } else {
+                // Records are "<length> <key>=<value>\n"
+                std::size_t pos = 0;
+                while (pos < data.size()) {
+                    std::size_t length = 0;
+                    std::size_t space = data.find(' ', pos);
+                    if (space == data.npos || !from_string(data.substr(pos, space - pos), length) ||
+                        length == 0 || pos + length > data.size()) {
+                        break;
+                    }
+
+                    std::string record = data.substr(space + 1, pos + length - space - 2);
+                    if (record.compare(0, 5, "path=") == 0) {
+                        long_name = record.substr(5);
+                    }
+
+                    pos += length;
+                }
+            }
+
+            f.tar_padding = padding;
+        } else if ((type == '0' || type == '\0') && size != 0) {
+            if (!long_name.empty()) {
+                f.tar_member = long_name;
+            } else {
+                // Only POSIX headers have a prefix; old GNU ones ("ustar  ")
+                // keep other fields there
+                bool posix = std::memcmp(header + 257, "ustar\0", 6) == 0;
+                std::string prefix = posix ? tar_string(header + 345, 155) : "";
+                std::string name = tar_string(header, 100);
+                f.tar_member = prefix.empty() ? name : prefix + "/" + name;
+            }
+
+            f.tar_remaining = size;
+            f.tar_padding = padding;
+            return true;
+        } else {
+            // Directories, links, empty files: nothing to convert
+            f.tar_padding = size + padding;
+            long_name.clear();
+        }
+    }
+}
+
+bool batch_compresses_output(compression c, int gzip_level) {
+    return gzip_level > 0 || (gzip_level < 0 && c == compression::gzip);
+}
+
+std::string batch_output_path(const std::string& input_path, compression c, int gzip_level) {
+    std::string base = input_path;
+    if (c == compression::gzip && ends_with(base, ".gz")) {
+        base.erase(base.size() - 3);
+    }
+
+    return base + (batch_compresses_output(c, gzip_level) ? ".out.gz" : ".out");
+}
+
+// Checks that no two inputs write to the same output, which would mix their
+// lines (such as 'x.txt' and 'x.txt.gz' with --gzip-level 0, or a file given
+// twice), and that no output overwrites an input.
+bool check_batch_outputs(const std::vector<std::string>& paths, int gzip_level) {
+    std::map<std::string, std::string> outputs;
+    for (auto& p : paths) {
+        // Streams cannot be probed without losing their first bytes, so
+        // they get both outputs they may write to
+        std::vector<std::string> candidates;
+        std::uint64_t size;
+        input_type type = stat_input(p, size);
+        if (p == "-") {
+            candidates.push_back("-");
+        } else if (type == input_type::regular) {
+            std::ifstream in(p, std::ios::binary);
+            if (!in.is_open()) continue; // reported when converting
+
+            candidates.push_back(batch_output_path(p, detect_compression(in, true), gzip_level));
+        } else if (type == input_type::stream) {
+            candidates.push_back(batch_output_path(p, compression::none, gzip_level));
+            candidates.push_back(batch_output_path(p, compression::gzip, gzip_level));
+        }
+
+        for (auto& output : candidates) {
+            auto iter = outputs.find(output);
+            if (iter != outputs.end()) {
+                if (iter->second == p) {
+                    std::cerr << "error: '" << p << "' is given more than once" << std::endl;
+                } else {
+                    std::cerr << "error: '" << iter->second << "' and '" << p << "' would both be written to '"
+                        << output << "'" << std::endl;
+                }
+
+                return false;
+            }
+        }
+
+        for (auto& output : candidates) {
+            outputs[output] = p;
+        }
+    }
+
+    for (auto& p : paths) {
+        auto iter = outputs.find(p);
+        if (p != "-" && iter != outputs.end()) {
+            std::cerr << "error: '" << iter->second << "' would be written to '" << p
+                << "', which is also an input" << std::endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Opens the input and output streams of a file, with the file's mutex held.
+bool open_batch_file(batch_file& f, batch_stats& stats) {
+    bool from_stdin = f.input_path == "-";
+    bool seekable = f.type == input_type::regular;
+    if (f.type == input_type::directory) {
+        batch_error(f, stats, "'" + f.input_path + "' is a directory");
+        return false;
+    }
+
+    if (from_stdin) {
+        f.in = &std::cin;
+    } else {
+        f.in_file.reset(new std::ifstream(f.input_path, std::ios::binary));
+        if (!f.in_file->is_open()) {
+            batch_error(f, stats, "could not open '" + f.input_path + "'");
+            return false;
+        }
+
+        f.in = f.in_file.get();
+    }
+
+    compression c = detect_compression(*f.in, seekable);
+    if (seekable && c == compression::none) {
+        archive a = detect_archive(*f.in);
+        if (a == archive::zip) {
+            batch_error(f, stats, "'" + f.input_path + "' is a zip archive, which is not "
+                "supported; convert it to a tar archive first");
+            return false;
+        }
+
+        f.tar = a == archive::tar;
+    } else if (c == compression::gzip) {
+        f.tar = ends_with(f.input_path, ".tar.gz") || ends_with(f.input_path, ".tgz");
+    }
+
+    if (f.in->fail()) {
+        batch_error(f, stats, "could not read '" + f.input_path + "'");
+        return false;
+    }
+
+    if (c == compression::zstd) {
+        batch_error(f, stats, "'" + f.input_path + "' is zstd-compressed, which is not "
+            "supported; decompress it first (zstd -dc)");
+        return false;
+    }
+
+    if (c == compression::gzip) {
+#ifdef KITCHENCONV_WITH_ZLIB
+        f.in_gzip.reset(new gzip_istream(*f.in));
+        f.in = f.in_gzip.get();
+#else
+        batch_error(f, stats, "'" + f.input_path + "' is gzip-compressed, but this build "
+            "has no zlib support; decompress it first (zcat)");
+        return false;
+#endif
+    }
+
+    if (!f.write_output) {
+        return true;
+    } else if (from_stdin) {
+        f.out = &std::cout;
+    } else {
+        f.output_path = batch_output_path(f.input_path, c, f.gzip_level);
+        f.out_file.reset(new std::ofstream(f.output_path, std::ios::binary));
+        if (!f.out_file->is_open()) {
+            batch_error(f, stats, "could not open '" + f.output_path + "'");
+            return false;
+        }
+
+        f.out = f.out_file.get();
+    }
+
+#ifdef KITCHENCONV_WITH_ZLIB
+    if (batch_compresses_output(c, f.gzip_level)) {
+        f.out_gzip.reset(new gzip_ostream(*f.out, f.gzip_level < 0 ? Z_DEFAULT_COMPRESSION : f.gzip_level));
+        f.out = f.out_gzip.get();
+    }
+#endif
+
+    return true;
+}
+
+// Reads the next chunk of whole lines, with the file's mutex held. Returns
+// false when the file has no more input.
+bool read_batch_chunk(batch_file& f, batch_stats& stats, std::string& chunk,
+    std::size_t chunk_size, std::string& tag) {
+
+    if (f.read_done) return false;
+
+    if (!f.in && !open_batch_file(f, stats)) {
+        f.read_done = true;
+        finish_batch_file(f, stats);
+        return false;
+    }
+
+    tag.clear();
+    chunk.clear();
+    if (f.tar) {
+        if (f.tar_remaining == 0 && !next_tar_member(f, stats)) {
+            f.read_done = true;
+        } else {
+            tag = f.tar_member;
+
+            std::size_t size = std::min<std::uint64_t>(chunk_size, f.tar_remaining);
+            chunk.resize(size);
+            f.in->read(&chunk[0], size);
+            chunk.resize(f.in->gcount());
+            f.tar_remaining -= chunk.size();
+
+            // Complete the last line, within the member
+            while (f.tar_remaining != 0 && !chunk.empty() && chunk.back() != '\n') {
+                int c = f.in->get();
+                if (c == std::istream::traits_type::eof()) break;
+                chunk += char(c);
+                --f.tar_remaining;
+            }
+
+            if (f.tar_remaining != 0 && f.in->eof()) {
+                batch_error(f, stats, "truncated tar archive '" + f.input_path + "'");
+                f.read_done = true;
+            }
+        }
+    } else {
+        chunk.resize(chunk_size);
+        f.in->read(&chunk[0], chunk_size);
+        chunk.resize(f.in->gcount());
+
+        if (!f.in->eof()) {
+            // Complete the last line
+            std::string rest;
+            if (std::getline(*f.in, rest)) {
+                chunk += rest;
+                chunk += '\n';
+            }
+
+            if (f.in->peek() == std::istream::traits_type::eof()) {
+                f.read_done = true;
+            }
+        } else {
+            f.read_done = true;
+        }
+    }
+
+    if (f.in->bad()) {
+        f.read_done = true;
+        batch_error(f, stats, "could not read '" + f.input_path + "'");
+    }
+#ifdef KITCHENCONV_WITH_ZLIB
+    else if (f.read_done && f.in_gzip && !f.in_gzip->error().empty()) {
+        batch_error(f, stats, "could not read '" + f.input_path + "': " + f.in_gzip->error());
+    } else if (f.read_done && f.in_gzip && f.in_gzip->trailing_garbage()) {
+        batch_warning("ignored trailing data after the gzip stream of '" + f.input_path + "'");
+    }
+#endif
+
+    if (chunk.empty()) {
+        if (f.read_done && f.chunks_written == f.chunks_read) {
+            finish_batch_file(f, stats);
+        }
+
+        return false;
+    }
+
+    return true;
+}
+
+void write_batch_chunk(batch_file& f, batch_stats& stats, std::size_t id, std::string output) {
+    std::lock_guard<std::mutex> lock(f.mutex);
+    f.pending[id] = std::move(output);
+    auto iter = f.pending.begin();
+    while (iter != f.pending.end() && iter->first == f.chunks_written) {
+        if (f.out) f.out->write(iter->second.data(), iter->second.size());
+        iter = f.pending.erase(iter);
+        ++f.chunks_written;
+    }
+
+    if (f.read_done && f.chunks_written == f.chunks_read) {
+        finish_batch_file(f, stats);
+    }
+}
+
+// Converts each line of the chunk; 'tag' (the archive member name), when not
+// empty, is written in front of each output line.
+void convert_batch_chunk(const std::string& chunk, const std::string& tag, std::string& output,
+    batch_stats& stats, perf_stages& perf) {
+
+    std::uint64_t lines = 0, errors = 0;
+    std::vector<std::string> words;
+    std::ostringstream result, err;
+
+    output.clear();
+    std::size_t pos = 0;
+    while (pos < chunk.size()) {
+        std::size_t end = chunk.find('\n', pos);
+        if (end == chunk.npos) end = chunk.size();
+
+        perf.begin("split");
+        words.clear();
+        std::size_t i = pos;
+        while (i < end) {
+            while (i < end && std::isspace(static_cast<unsigned char>(chunk[i]))) ++i;
+            std::size_t word_start = i;
+            while (i < end && !std::isspace(static_cast<unsigned char>(chunk[i]))) ++i;
+            if (i > word_start) words.emplace_back(chunk, word_start, i - word_start);
+        }
+
+        if (!tag.empty()) {
+            output += tag;
+            output += ':';
+        }
+
+        if (!words.empty()) {
+            ++lines;
+            result.str("");
+            err.str("");
+            if (convert_request(words, result, err, false, perf)) {
+                output += result.str();
+            } else {
+                ++errors;
+                std::string message = err.str();
+                output.append(message, 0, message.find('\n'));
+            }
+        }
+
+        output += '\n';
+        pos = end + 1;
+    }
+
+    stats.lines += lines;
+    stats.errors += errors;
+}
+
+// Chooses the chunk size and the number of threads from the throughput
+// measured over windows of half a second, unless they were given on the
+// command line. Chunks should take about 10 ms to convert: much less and the
+// locking and bookkeeping start to show, much more and threads sit idle at
+// the end of the run. Reads and writes (including gzip) are serialized per
+// file, so each open file keeps busy at most busy/io threads; the thread
+// count is capped by that times the number of files still open, and goes
+// back up when the measurements allow it. Only integers are used, so that
+// the fixed-point build stays free of floating point.
+struct batch_tuner {
+    typedef std::chrono::steady_clock clock;
+
+    bool tune_chunk_size = true;
+    bool tune_threads = true;
+    std::atomic<std::size_t> chunk_size{64*1024};
+    std::atomic<std::size_t> threads{1};
+    std::size_t max_threads = 1;
+
+    std::mutex mutex;
+    clock::time_point window_start = clock::now();
+    bool done = false;
+    bool logged = false;
+    std::uint64_t bytes = 0;
+    std::uint64_t io_ns = 0;
+    std::uint64_t convert_ns = 0;
+
+    void sample(std::size_t chunk_bytes, std::uint64_t chunk_io_ns, std::uint64_t chunk_convert_ns,
+        std::size_t open_files) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (done) return;
+
+        bytes += chunk_bytes;
+        io_ns += chunk_io_ns;
+        convert_ns += chunk_convert_ns;
+
+        if (clock::now() - window_start < std::chrono::milliseconds(500)) return;
+
+        std::uint64_t busy_ns = io_ns + convert_ns;
+        if (busy_ns != 0) {
+            std::size_t old_threads = threads;
+            if (tune_chunk_size) {
+                std::uint64_t size = bytes*10000000/busy_ns; // 10 ms of work
+                size = std::min<std::uint64_t>(std::max<std::uint64_t>(size, 16*1024), 16*1024*1024);
+                chunk_size = size - size % 1024;
+            }
+
+            if (tune_threads) {
+                std::uint64_t per_file = io_ns == 0 ? max_threads : (busy_ns + io_ns - 1)/io_ns;
+                std::uint64_t cap = per_file*std::max<std::size_t>(open_files, 1);
+                threads = std::min<std::uint64_t>(max_threads, cap);
+            }
+
+            if (!logged || threads != old_threads) {
+                log();
+            }
+        }
+
+        window_start = clock::now();
+        bytes = io_ns = convert_ns = 0;
+    }
+
+    // Logs the chosen values if no window completed, for short runs
+    void finish() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!done && !logged) log();
+    }
+
+private:
+    void log() {
+        logged = true;
+        std::uint64_t busy_ns = io_ns + convert_ns;
+        std::cerr << "note: batch tuning: " << chunk_size/1024 << " KiB chunks, " << threads
+            << " thread(s)";
+        if (busy_ns != 0) {
+            std::uint64_t speed = bytes*10000/busy_ns; // tenths of MB/s
+            std::cerr << " (" << speed/10 << "." << speed%10 << " MB/s per thread, "
+                << io_ns*100/busy_ns << "% of time in I/O)";
+        }
+
+        std::cerr << std::endl;
+    }
+};
+
+// Converts the chunks, or only gathers statistics in 'lint' if not null.
+// CPU counters are read into 'counters' if not null.
+void batch_worker(std::vector<std::unique_ptr<batch_file>>& files,
+    std::atomic<std::size_t>& first_file, std::size_t index, batch_tuner& tuner,
+    batch_stats& stats, lint_stats* lint, perf_stages* counters) {
+
+    typedef batch_tuner::clock clock;
+    auto nanoseconds = [](clock::duration d) {
+        return std::uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
+    };
+
+    perf_stages unused;
+    perf_stages& perf = counters ? *counters : unused;
+    if (counters) counters->open(false);
+
+    std::string chunk, tag, output;
+
+    while (first_file < files.size()) {
+        if (index >= tuner.threads) {
+            // Not needed for now, but the tuner may ask for more threads later
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            continue;
+        }
+
+        // Find the largest file which still has input to read
+        auto start = clock::now();
+        perf.begin("read");
+        batch_file* file = nullptr;
+        std::size_t id = 0;
+        for (std::size_t i = first_file; i < files.size() && !file; ++i) {
+            batch_file& f = *files[i];
+            std::lock_guard<std::mutex> lock(f.mutex);
+            if (read_batch_chunk(f, stats, chunk, tuner.chunk_size, tag)) {
+                file = &f;
+                id = f.chunks_read++;
+            } else if (f.read_done) {
+                std::size_t expected = i;
+                first_file.compare_exchange_strong(expected, i + 1);
+            }
+        }
+
+        if (!file) {
+            // Everything was read: release the threads waiting for work
+            first_file = files.size();
+            break;
+        }
+
+        auto read_end = clock::now();
+        stats.bytes += chunk.size();
+        if (lint) {
+            perf.begin("lint");
+            lint_batch_chunk(chunk, *lint);
+            output.clear();
+        } else {
+            convert_batch_chunk(chunk, tag, output, stats, perf);
+        }
+
+        auto convert_end = clock::now();
+        perf.begin("write");
+        write_batch_chunk(*file, stats, id, std::move(output));
+        perf.end();
+        auto write_end = clock::now();
+
+        tuner.sample(chunk.size(), nanoseconds(read_end - start) + nanoseconds(write_end - convert_end),
+            nanoseconds(convert_end - read_end), files.size() - first_file);
+    }
+}
+
+int run_batch(const std::vector<std::string>& paths, std::size_t jobs, std::size_t chunk_kib,
+    int gzip_level, bool lint, bool use_perf_counters) {
+    if (paths.empty()) {
+        std::cerr << "error: no input file given for batch mode" << std::endl;
+        return 1;
+    }
+
+    if (!lint && !check_batch_outputs(paths, gzip_level)) return 1;
+
+    // Checked here, since workers open their own counters without notes
+    perf_stages total_perf;
+    total_perf.report_at_exit = false;
+    if (use_perf_counters && !total_perf.open()) return 1;
+
+    std::vector<std::unique_ptr<batch_file>> files;
+    files.reserve(paths.size());
+    for (auto& p : paths) {
+        std::unique_ptr<batch_file> f(new batch_file);
+        f->input_path = p;
+        f->gzip_level = gzip_level;
+        f->write_output = !lint;
+        f->type = stat_input(p, f->size);
+
+        files.push_back(std::move(f));
+    }
+
+    std::stable_sort(files.begin(), files.end(),
+        [](const std::unique_ptr<batch_file>& f1, const std::unique_ptr<batch_file>& f2) {
+            return f1->size > f2->size;
+        }
+    );
+
+    batch_tuner tuner;
+    if (jobs == 0) {
+        jobs = std::min<std::size_t>(max_batch_jobs, std::max(1u, std::thread::hardware_concurrency()));
+    } else {
+        tuner.tune_threads = false;
+    }
+
+    if (chunk_kib != 0) {
+        tuner.chunk_size = chunk_kib*1024;
+        tuner.tune_chunk_size = false;
+    }
+
+    tuner.threads = jobs;
+    tuner.max_threads = jobs;
+    if (!tuner.tune_threads && !tuner.tune_chunk_size) {
+        tuner.done = true;
+    }
+
+    std::ios::sync_with_stdio(false);
+
+    batch_stats stats;
+    std::vector<lint_stats> worker_lint(lint ? jobs : 0);
+    std::vector<perf_stages> worker_perf(use_perf_counters ? jobs : 0);
+    std::atomic<std::size_t> first_file(0);
+    std::vector<std::thread> workers;
+    for (std::size_t i = 0; i < jobs; ++i) {
+        if (use_perf_counters) worker_perf[i].report_at_exit = false;
+        try {
+            workers.emplace_back(batch_worker, std::ref(files), std::ref(first_file), i,
+                std::ref(tuner), std::ref(stats), lint ? &worker_lint[i] : nullptr,
+                use_perf_counters ? &worker_perf[i] : nullptr);
+        } catch (const std::system_error& e) {
+            // Go on with the threads already running, if any
+            std::cerr << "warning: could not start batch thread " << i + 1 << ": " << e.what() << std::endl;
+            std::lock_guard<std::mutex> lock(tuner.mutex);
+            tuner.threads = tuner.max_threads = i;
+            break;
+        }
+    }
+
+    if (workers.empty()) {
+        std::cerr << "error: could not start any batch thread" << std::endl;
+        return 1;
+    }
+
+    for (auto& w : workers) {
+        w.join();
+    }
+
+    tuner.finish();
+
+    std::uint64_t lines = stats.lines;
+    if (lint) {
+        lint_stats total;
+        for (auto& l : worker_lint) {
+            total.merge(l);
+        }
+
+        print_lint_report(total);
+        lines = total.lines;
+    } else {
+        std::cerr << "note: converted " << stats.lines << " lines from " << files.size()
+            << " file(s), " << stats.errors << " with errors" << std::endl;
+    }
+
+    if (use_perf_counters) {
+        perf_stages merged;
+        merged.report_at_exit = false;
+        for (auto& p : worker_perf) {
+            merged.merge(p);
+        }
+
+        merged.report(lines, "per line", stats.bytes);
+    }
+
+    return stats.failed ? 1 : 0;
+}
+
+// Recipe extraction
+// =================
+//
+// Scans HTML or JSON files for the schema.org "recipeIngredient" lists
+// embedded as JSON-LD, without building a DOM or a JSON tree: the scanner
+// looks for the key and decodes the strings of the list that follows, as
+// the input streams through. Each ingredient is normalized with
+// parse_ingredient(), and one JSON record is written per ingredient.
+
+class ingredient_scanner {
+public:
+    // Calls on_ingredient(const std::string&) for each ingredient found, and
+    // on_recipe_end() after the last ingredient of each list
+    template<typename F, typename G>
+    void feed(const char* data, std::size_t size, F&& on_ingredient, G&& on_recipe_end) {
+        static const std::string key = "\"recipeIngredient\"";
+
+        for (std::size_t i = 0; i < size; ++i) {
+            char c = data[i];
+            switch (state_) {
+            case state::search:
+                if (c == key[matched_]) {
+                    if (++matched_ == key.size()) {
+                        matched_ = 0;
+                        state_ = state::colon;
+                    }
+                } else {
+                    matched_ = c == key[0] ? 1 : 0;
+                }
+                break;
+            case state::colon:
+                if (c == ':') {
+                    state_ = state::value;
+                } else if (!std::isspace(static_cast<unsigned char>(c))) {
+                    state_ = state::search;
+                }
+                break;
+            case state::value:
+                // Either a list of strings, or a single string
+                if (c == '[') {
+                    in_list_ = true;
+                    state_ = state::list;
+                } else if (c == '"') {
+                    in_list_ = false;
+                    value_.clear();
+                    state_ = state::string;
+                } else if (!std::isspace(static_cast<unsigned char>(c))) {
+                    state_ = state::search;
+                }
+                break;
+            case state::list:
+                if (c == '"') {
+                    value_.clear();
+                    state_ = state::string;
+                } else if (c != ',' && !std::isspace(static_cast<unsigned char>(c))) {
+                    on_recipe_end();
+                    state_ = state::search;
+                }
+                break;
+            case state::string:
+                if (c == '"') {
+                    on_ingredient(value_);
+                    if (!in_list_) on_recipe_end();
+                    state_ = in_list_ ? state::list : state::search;
+                } else if (c == '\\') {
+                    state_ = state::escape;
+                } else {
+                    value_ += c;
+                }
+                break;
+            case state::escape:
+                state_ = state::string;
+                switch (c) {
+                    case 'b' : value_ += '\b'; break;
+                    case 'f' : value_ += '\f'; break;
+                    case 'n' : value_ += '\n'; break;
+                    case 'r' : value_ += '\r'; break;
+                    case 't' : value_ += '\t'; break;
+                    case 'u' :
+                        code_ = 0;
+                        digits_ = 0;
+                        state_ = state::unicode;
+                        break;
+                    default : value_ += c; break;
+                }
+                break;
+            case state::unicode:
+                if (!std::isxdigit(static_cast<unsigned char>(c))) {
+                    state_ = state::string;
+                    break;
+                }
+
+                code_ = 16*code_ + (std::isdigit(static_cast<unsigned char>(c)) ?
+                    c - '0' : std::tolower(c) - 'a' + 10);
+                if (++digits_ == 4) {
+                    append_code(code_);
+                    state_ = state::string;
+                }
+                break;
+            }
+        }
+    }
+
+private:
+    // Appends a UTF-16 code unit as UTF-8, combining surrogate pairs
+    void append_code(std::uint32_t code) {
+        if (code >= 0xd800 && code < 0xdc00) {
+            high_surrogate_ = code;
+            return;
+        } else if (code >= 0xdc00 && code < 0xe000) {
+            if (high_surrogate_ == 0) return;
+            code = 0x10000 + ((high_surrogate_ - 0xd800) << 10) + (code - 0xdc00);
+        }
+
+        high_surrogate_ = 0;
+        if (code < 0x80) {
+            value_ += char(code);
+        } else if (code < 0x800) {
+            value_ += char(0xc0 | (code >> 6));
+            value_ += char(0x80 | (code & 0x3f));
+        } else if (code < 0x10000) {
+            value_ += char(0xe0 | (code >> 12));
+            value_ += char(0x80 | ((code >> 6) & 0x3f));
+            value_ += char(0x80 | (code & 0x3f));
+        } else {
+            value_ += char(0xf0 | (code >> 18));
+            value_ += char(0x80 | ((code >> 12) & 0x3f));
+            value_ += char(0x80 | ((code >> 6) & 0x3f));
+            value_ += char(0x80 | (code & 0x3f));
+        }
+    }
+
+    enum class state {
+        search,
+        colon,
+        value,
+        list,
+        string,
+        escape,
+        unicode
+    };
+
+    state state_ = state::search;
+    std::size_t matched_ = 0;
+    bool in_list_ = false;
+    std::string value_;
+    std::uint32_t code_ = 0;
+    std::uint32_t high_surrogate_ = 0;
+    int digits_ = 0;
+};
+
+std::string json_string(const std::string& s) {
+    std::string r = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            r += '\\';
+            r += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            const char* hex = "0123456789abcdef";
+            r += "\\u00";
+            r += hex[c >> 4];
+            r += hex[c & 0xf];
+        } else {
+            r += c;
+        }
+    }
+
+    return r + "\"";
+}
+
+int run_recipes(const std::vector<std::string>& paths, bool nutrition, bool use_perf_counters) {
+    if (paths.empty()) {
+        std::cerr << "error: no input file given for recipe extraction" << std::endl;
+        return 1;
+    }
+
+    perf_stages perf;
+    perf.report_at_exit = false;
+    if (use_perf_counters && !perf.open()) return 1;
+
+    std::ios::sync_with_stdio(false);
+
+    bool failed = false;
+    std::uint64_t found = 0, errors = 0, bytes = 0;
+    std::vector<char> buffer(64*1024);
+    for (auto& path : paths) {
+        std::uint64_t size;
+        input_type type = stat_input(path, size);
+        if (type == input_type::directory) {
+            std::cerr << "error: '" << path << "' is a directory" << std::endl;
+            failed = true;
+            continue;
+        }
+
+        std::istream* in = &std::cin;
+        std::unique_ptr<std::ifstream> file;
+        if (path != "-") {
+            file.reset(new std::ifstream(path, std::ios::binary));
+            if (!file->is_open()) {
+                std::cerr << "error: could not open '" << path << "'" << std::endl;
+                failed = true;
+                continue;
+            }
+
+            in = file.get();
+        }
+
+#ifdef KITCHENCONV_WITH_ZLIB
+        std::unique_ptr<gzip_istream> gzip;
+        if (detect_compression(*in, type == input_type::regular) == compression::gzip) {
+            gzip.reset(new gzip_istream(*in));
+            in = gzip.get();
+        }
+
+        if (in->fail()) {
+            std::cerr << "error: could not read '" << path << "'" << std::endl;
+            failed = true;
+            continue;
+        }
+#endif
+
+        ingredient_scanner scanner;
+        ingredient ing;
+        std::string error;
+        nutrients totals;
+        totals.fill(0);
+        std::size_t known = 0, unknown = 0;
+        auto on_ingredient = [&](const std::string& text) {
+            ++found;
+            std::cout << "{\"source\":" << json_string(path) << ",\"ingredient\":" << json_string(text);
+            bool converted = parse_ingredient(text, ing, error);
+            if (converted) {
+                std::cout << ",\"quantity\":" << format_number(ing.quantity) << ",\"unit\":\"" << ing.unit << "\"";
+                if (!ing.substance.empty()) {
+                    std::cout << ",\"substance\":" << json_string(ing.substance);
+                }
+            } else {
+                ++errors;
+                std::cout << ",\"error\":" << json_string(error);
+            }
+
+            std::cout << "}\n";
+
+            if (nutrition) {
+                auto iter = nutrient_table.find(ing.substance);
+                if (converted && ing.unit == "g" && iter != nutrient_table.end() &&
+                    add_nutrients(totals, iter->second, ing.quantity)) {
+                    ++known;
+                } else {
+                    ++unknown;
+                }
+            }
+        };
+
+        auto on_recipe_end = [&]() {
+            if (!nutrition) return;
+
+            std::cout << "{\"source\":" << json_string(path) << ",\"nutrition\":{";
+            for (std::size_t i = 0; i < nutrient_count; ++i) {
+                std::cout << (i == 0 ? "" : ",") << "\"" << nutrient_names[i] << "\":"
+                    << format_number(totals[i]);
+            }
+
+            std::cout << "},\"ingredients\":" << known << ",\"unknown_ingredients\":" << unknown << "}\n";
+
+            totals.fill(0);
+            known = unknown = 0;
+        };
+
+        while (*in) {
+            perf.begin("read");
+            in->read(buffer.data(), buffer.size());
+            bytes += in->gcount();
+            perf.begin("extract");
+            scanner.feed(buffer.data(), in->gcount(), on_ingredient, on_recipe_end);
+            perf.end();
+        }
+
+        if (in->bad()) {
+            std::cerr << "error: could not read '" << path << "'" << std::endl;
+            failed = true;
+        }
+#ifdef KITCHENCONV_WITH_ZLIB
+        else if (gzip && !gzip->error().empty()) {
+            std::cerr << "error: could not read '" << path << "': " << gzip->error() << std::endl;
+            failed = true;
+        } else if (gzip && gzip->trailing_garbage()) {
+            std::cerr << "warning: ignored trailing data after the gzip stream of '" << path << "'" << std::endl;
+        }
+#endif
+    }
+
+    std::cout.flush();
+    std::cerr << "note: found " << found << " ingredients in " << paths.size()
+        << " file(s), " << errors << " could not be converted" << std::endl;
+
+    if (use_perf_counters) perf.report(found, "per ingr.", bytes);
+
+    return failed ? 1 : 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (!check_nutrient_table()) return 1;
+
+    std::vector<std::string> args;
+    bool use_perf_counters = false;
+    bool batch = false;
+    bool recipes = false;
+    bool nutrition = false;
+    bool lint = false;
+    bool search = false;
+    std::size_t jobs = 0;
+    std::size_t chunk_kib = 0;
+    int gzip_level = -1;
+    for (int i = 1; i < argc; ++i) {
+        if (std::string(argv[i]) == "--perf-counters") {
+            use_perf_counters = true;
+        } else if (std::string(argv[i]) == "--batch") {
+            batch = true;
+        } else if (std::string(argv[i]) == "--lint") {
+            lint = true;
+        } else if (std::string(argv[i]) == "--recipes") {
+            recipes = true;
+        } else if (std::string(argv[i]) == "--nutrition") {
+            nutrition = true;
+        } else if (std::string(argv[i]) == "--search") {
+            search = true;
+        } else if (std::string(argv[i]) == "-j" || std::string(argv[i]) == "--jobs") {
+            if (i+1 == argc || !from_string(argv[i+1], jobs) || jobs == 0 || jobs > max_batch_jobs) {
+                std::cerr << "error: " << argv[i] << " expects a number of threads from 1 to "
+                    << max_batch_jobs << std::endl;
+                return 1;
+            }
+
+            ++i;
+        } else if (std::string(argv[i]) == "--chunk-size") {
+            if (i+1 == argc || !from_string(argv[i+1], chunk_kib) || chunk_kib == 0 || chunk_kib > max_chunk_kib) {
+                std::cerr << "error: " << argv[i] << " expects a size in KiB, up to "
+                    << max_chunk_kib << std::endl;
+                return 1;
+            }
+
+            ++i;
+        } else if (std::string(argv[i]) == "--gzip-level") {
+#ifndef KITCHENCONV_WITH_ZLIB
+            std::cerr << "error: " << argv[i] << ": this build has no zlib support" << std::endl;
+            return 1;
+#endif
+            if (i+1 == argc || !from_string(argv[i+1], gzip_level) || gzip_level < 0 || gzip_level > 9) {
+                std::cerr << "error: " << argv[i] << " expects a level from 0 to 9" << std::endl;
+                return 1;
+            }
+
+            ++i;
+#if defined(KITCHENCONV_FIXED_POINT) && !defined(KITCHENCONV_NO_ACCURACY_REPORT)
+        } else if (std::string(argv[i]) == "--accuracy-report") {
+            return accuracy_report();
+#endif
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+
+    if (batch || lint) {
+        return run_batch(args, jobs, chunk_kib, gzip_level, lint, use_perf_counters);
+    } else if (recipes) {
+        return run_recipes(args, nutrition, use_perf_counters);
+    } else if (search) {
+        std::string text;
+        for (auto& a : args) {
+            text += (text.empty() ? "" : " ") + a;
+        }
+
+        std::vector<std::string> names = search_ingredients(text);
+        if (names.empty()) {
+            std::cerr << "error: no ingredient matches '" << text << "'" << std::endl;
+            return 1;
+        }
+
+        for (auto& n : names) {
+            std::cout << "  " << n << " (" << format_number(density_table.at(n)) << " g/ml)" << std::endl;
+        }
+
+        return 0;
+    }
+
+    perf_stages perf;
+    if (use_perf_counters && !perf.open()) return 1;
+
+    if (args.size() < 4) {
+        std::cout << "usage examples:" << std::endl;
+        std::cout << "  kitchenconv 10 kg to lb" << std::endl;
+        std::cout << "  kitchenconv 400 F in C" << std::endl;
+        std::cout << "  kitchenconv 1 tbs butter to g" << std::endl;
+        std::cout << "  kitchenconv 3 ts of sugar to g" << std::endl;
+        std::cout << "  kitchenconv 3/4 cup to ml" << std::endl;
+        std::cout << "  kitchenconv --batch recipes1.txt recipes2.txt" << std::endl;
+        std::cout << "  kitchenconv --recipes page1.html page2.json" << std::endl;
+        std::cout << "  kitchenconv --search flour" << std::endl;
+        std::cout << "options:" << std::endl;
+        std::cout << "  --batch          convert each line of the given files into <file>.out" << std::endl;
+        std::cout << "  --lint           check the ingredient lines of the given files, and report outliers" << std::endl;
+        std::cout << "  --recipes        extract and normalize schema.org recipe ingredients" << std::endl;
+        std::cout << "  --nutrition      with --recipes, also print nutrition totals of each recipe" << std::endl;
+        std::cout << "  --search <text>  list the known ingredients whose name contains the text" << std::endl;
+        std::cout << "  -j, --jobs <n>   number of batch threads (default: tuned, up to one per core)" << std::endl;
+        std::cout << "  --chunk-size <k> size of batch chunks in KiB (default: tuned)" << std::endl;
+#ifdef KITCHENCONV_WITH_ZLIB
+        std::cout << "  --gzip-level <n> gzip level of batch outputs, 0 for none (default: 6 for gzip inputs)" << std::endl;
+#endif
+        std::cout << "  --perf-counters  report CPU counters for each stage" << std::endl;
+#if defined(KITCHENCONV_FIXED_POINT) && !defined(KITCHENCONV_NO_ACCURACY_REPORT)
+        std::cout << "  --accuracy-report  compare fixed-point results with double arithmetic" << std::endl;
+#endif
+        return 1;
+    }
+
+    std::ostringstream result;
+    if (!convert_request(args, result, std::cerr, true, perf)) return 1;
+
+    std::cout << "  " << result.str() << std::endl;
 
     return 0;
 }